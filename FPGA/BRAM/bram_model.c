@@ -0,0 +1,90 @@
+/* 
+ * Software model of the PL BRAM for mmap_myHW.ko
+ *
+ * Registers a "mchar-bram" platform device backed by physically contiguous
+ * kernel memory instead of the BRAM at 0x40000000, so the whole mchar data
+ * path (copy engines, sessions, mmap, sync) can be regression tested and
+ * benchmarked on any x86/arm Linux host, no FPGA needed.
+ *
+ * access_ns is the modelled latency of the AXI bus per 32 bit word, instead
+ * of the speed of the DDR. mmap_myHW.c charges it (bram_model_delay()) after
+ * every read(), write() and MCHAR_IOC_SYNC copy: a busy wait for short
+ * transfers, a sleep above 20 us. Stores to the BRAM mmaped by the
+ * application (MCHAR_MMAP_BRAM_UC/WC) don't go through the driver, so they
+ * run at RAM speed whatever access_ns says.
+ *
+ *  $ make clean ; make
+ *  $ sudo insmod bram_model.ko size=8192 access_ns=10
+ *  $ sudo insmod mmap_myHW.ko
+ *
+ * size is limited to what alloc_pages_exact() can give (4 MB usually).
+ * The model can't be removed while /dev/mchar is open.
+ * 
+ * Author  :   Sergio Rivera <srivera@alumnos.upm.es>
+ * 
+*/
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/init.h> 
+#include <linux/moduleparam.h>
+#include <linux/platform_device.h>
+#include <linux/gfp.h>
+#include <linux/mm.h>
+
+#include "mmap_myHW.h"
+
+static unsigned long size = 0x2000;     /* as the BRAM of HW/ *_BRAM_project.tcl */
+module_param(size, ulong, S_IRUGO);
+MODULE_PARM_DESC(size, "bytes of the software BRAM");
+
+static unsigned int access_ns = 0;
+module_param(access_ns, uint, S_IRUGO);
+MODULE_PARM_DESC(access_ns, "ns added per 32 bit word transferred, 0 = RAM speed");
+
+static struct platform_device *pdev = NULL;
+static void *mem = NULL;
+
+static int __init bram_model_init(void)
+{
+    struct mchar_bram_pdata pdata;
+
+    if (size == 0 || size & 3) {
+        pr_err("bram_model: size must be a non zero multiple of 4\n");
+        return -EINVAL;
+    }
+
+    mem = alloc_pages_exact(size, GFP_KERNEL | __GFP_ZERO);
+    if (mem == NULL) {
+        pr_err("bram_model: can't allocate %lu contiguous bytes\n", size);
+        return -ENOMEM;
+    }
+
+    pdata.vaddr = mem;
+    pdata.size = size;
+    pdata.access_ns = access_ns;
+    pdata.owner = THIS_MODULE;
+    pdev = platform_device_register_data(NULL, MCHAR_BRAM_DRIVER_NAME, PLATFORM_DEVID_NONE,
+                                         &pdata, sizeof(pdata));
+    if (IS_ERR(pdev)) {
+        free_pages_exact(mem, size);
+        return PTR_ERR(pdev);
+    }
+
+    pr_info("bram_model: %lu bytes BRAM, %u ns per access\n", size, access_ns);
+    return 0;
+}
+
+static void __exit bram_model_exit(void)
+{
+    platform_device_unregister(pdev);
+    free_pages_exact(mem, size);
+    pr_info("bram_model: unregistered!");
+}
+
+module_init(bram_model_init);
+module_exit(bram_model_exit);
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("sergio rivera <srivera@alumnos.upm.es>");
+MODULE_DESCRIPTION("software BRAM for the mchar driver");
+MODULE_VERSION("1.0");
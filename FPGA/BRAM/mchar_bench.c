@@ -0,0 +1,361 @@
+/* x86_64 + arm
+ *
+ * Throughput/latency benchmark for /dev/mchar (replaces test_from_user_space.c)
+ *
+ *  1) sudo insmod mmap_myHW.ko   (or bram_model.ko first, without FPGA)
+ *  2) gcc -Wall -O2 -pthread -o mchar_bench mchar_bench.c ; sudo ./mchar_bench
+ *
+ * Every thread opens the device once, maps it once and then, for every
+ * transfer size of the sweep, runs the selected paths:
+ *
+ *   write   pwrite() of the whole size at offset 0
+ *   read    pread() of the whole size at offset 0
+ *   sync    store one word per page of the mmaped staging buffer and
+ *           MCHAR_IOC_SYNC (only the touched pages reach the BRAM)
+ *   direct  memcpy() to the write-combining mmap of the BRAM itself (on
+ *           bram_model.ko this skips its access_ns latency)
+ *   batch   a payload of -b bytes (default: all the device takes) written
+ *           in pwrite() batches of size bytes each, so the sweep shows
+ *           what a bigger staging buffer buys: batches up to 40 KB are
+ *           what the old 10 pages buffer allowed. Bigger batches need a
+ *           BRAM bigger than that, e.g. bram_model.ko size=4194304
+ *
+ * and reports MB/s, ops/s and latency percentiles as CSV (default) or JSON.
+ * A write/read/compare round trip is checked before measuring.
+ *
+ *  $ sudo ./mchar_bench -t 4 -s 256:8192 -p write,read,sync -n 2000 -j
+ *  $ sudo ./mchar_bench -s 4096 -p batch -n 100     (the staging buffer, at
+ *                                                    most the BRAM, decides
+ *                                                    the biggest batch)
+ *
+ * Author  :   Sergio Rivera <srivera@alumnos.upm.es>
+ *
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+
+#include "mmap_myHW.h"
+
+#define PATH_WRITE   0
+#define PATH_READ    1
+#define PATH_SYNC    2
+#define PATH_DIRECT  3
+#define PATH_BATCH   4
+#define PATH_NR      5
+
+static const char *path_name[PATH_NR] = { "write", "read", "sync", "direct", "batch" };
+
+static const char *device = MCHAR_DEVICE_FILENAME;
+static int nthreads = 1;
+static int iters = 1000;
+static size_t size_min = 64;
+static size_t size_max = 0;          /* 0: the whole BRAM */
+static size_t payload = 0;           /* batch path, 0: the whole BRAM */
+static int paths = (1 << PATH_WRITE) | (1 << PATH_READ) | (1 << PATH_SYNC);
+static int json = 0;
+static int json_open = 0;            /* "[" printed, "]" still due */
+
+static size_t bram_size;
+static long page_size;
+
+struct thread {
+    pthread_t tid;
+    int fd;
+    char *staging;                   /* MCHAR_MMAP_STAGING */
+    char *bram;                      /* MCHAR_MMAP_BRAM_WC, may be NULL */
+    char *buf;
+    int path;
+    size_t size;
+    uint64_t *lat;                   /* ns of every op */
+    int err;
+};
+
+static pthread_barrier_t start_line;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* message on stderr and exit 1, leaving -j output valid JSON */
+static void die(const char *what, int err) {
+    fprintf(stderr, "%s: %s\n", what, strerror(err));
+    if (json_open)
+        printf("\n]\n");
+    exit(1);
+}
+
+static void *xmalloc(size_t n) {
+    void *p = malloc(n);
+
+    if (p == NULL)
+        die("malloc", ENOMEM);
+    return p;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int one_op(struct thread *t) {
+    struct mchar_range range;
+    size_t off, n;
+
+    switch (t->path) {
+    case PATH_WRITE:
+        return pwrite(t->fd, t->buf, t->size, 0) == (ssize_t)t->size ? 0 : -1;
+    case PATH_READ:
+        return pread(t->fd, t->buf, t->size, 0) == (ssize_t)t->size ? 0 : -1;
+    case PATH_SYNC:
+        for (off = 0; off < t->size; off += page_size)
+            t->staging[off]++;
+        range.offset = 0;
+        range.len = t->size;
+        return ioctl(t->fd, MCHAR_IOC_SYNC, &range) < 0 ? -1 : 0;
+    case PATH_DIRECT:
+        memcpy(t->bram, t->buf, t->size);
+        return 0;
+    case PATH_BATCH:
+        for (off = 0; off < payload; off += n) {
+            n = payload - off < t->size ? payload - off : t->size;
+            if (pwrite(t->fd, t->buf + off, n, off) != (ssize_t)n)
+                return -1;
+        }
+        return 0;
+    }
+    return -1;
+}
+
+static void *thread_main(void *arg) {
+    struct thread *t = arg;
+    int i;
+
+    pthread_barrier_wait(&start_line);
+    for (i = 0; i < iters; i++) {
+        uint64_t t0 = now_ns();
+        if (one_op(t) < 0) {
+            t->err = errno;
+            break;
+        }
+        t->lat[i] = now_ns() - t0;
+    }
+    pthread_barrier_wait(&start_line);
+    return NULL;
+}
+
+/* one size of one path on every thread, then one line of report */
+static int run(struct thread *th, int path, size_t size, int first) {
+    uint64_t *all, t0, wall;
+    double mbs, ops;
+    size_t moved = path == PATH_BATCH ? payload : size;     /* bytes per op */
+    int i, err, n = nthreads * iters;
+
+    all = xmalloc(n * sizeof(*all));
+    for (i = 0; i < nthreads; i++) {
+        th[i].path = path;
+        th[i].size = size;
+        th[i].err = 0;
+        err = pthread_create(&th[i].tid, NULL, thread_main, &th[i]);
+        if (err)
+            die("pthread_create", err);     /* the others wait at start_line */
+    }
+    pthread_barrier_wait(&start_line);
+    t0 = now_ns();
+    pthread_barrier_wait(&start_line);
+    wall = now_ns() - t0;
+
+    for (i = 0; i < nthreads; i++)
+        pthread_join(th[i].tid, NULL);
+    for (i = 0; i < nthreads; i++) {
+        if (th[i].err) {
+            fprintf(stderr, "%s %zu bytes: %s\n", path_name[path], size, strerror(th[i].err));
+            free(all);
+            return -1;
+        }
+        memcpy(all + i * iters, th[i].lat, iters * sizeof(*all));
+    }
+    qsort(all, n, sizeof(*all), cmp_u64);
+
+    mbs = (double)moved * n * 1000.0 / wall;
+    ops = (double)n * 1e9 / wall;
+    if (json)
+        printf("%s{\"path\":\"%s\",\"bytes\":%zu,\"threads\":%d,\"ops\":%d,"
+               "\"MBps\":%.3f,\"ops_per_s\":%.1f,\"p50_ns\":%llu,\"p90_ns\":%llu,"
+               "\"p99_ns\":%llu,\"max_ns\":%llu}",
+               first ? "" : ",\n", path_name[path], size, nthreads, n, mbs, ops,
+               (unsigned long long)all[n / 2], (unsigned long long)all[n * 90 / 100],
+               (unsigned long long)all[n * 99 / 100], (unsigned long long)all[n - 1]);
+    else
+        printf("%s,%zu,%d,%d,%.3f,%.1f,%llu,%llu,%llu,%llu\n",
+               path_name[path], size, nthreads, n, mbs, ops,
+               (unsigned long long)all[n / 2], (unsigned long long)all[n * 90 / 100],
+               (unsigned long long)all[n * 99 / 100], (unsigned long long)all[n - 1]);
+    fflush(stdout);
+    free(all);
+    return 0;
+}
+
+/* write a pattern, read it back: the old "we are all good" check */
+static int round_trip(struct thread *t) {
+    char *back = xmalloc(bram_size);
+    size_t i;
+    int good = 1;
+
+    for (i = 0; i < bram_size; i++)
+        t->buf[i] = (char)(i * 7 + 1);
+    if (pwrite(t->fd, t->buf, bram_size, 0) != (ssize_t)bram_size ||
+        pread(t->fd, back, bram_size, 0) != (ssize_t)bram_size) {
+        perror("round trip");
+        good = 0;
+    }
+    for (i = 0; good && i < bram_size; i++) {
+        if (back[i] != t->buf[i]) {
+            fprintf(stderr, "error at byte %zu: %02x != %02x\n", i,
+                    (unsigned char)t->buf[i], (unsigned char)back[i]);
+            good = 0;
+        }
+    }
+    free(back);
+    return good ? 0 : -1;
+}
+
+static int parse_paths(char *s) {
+    int mask = 0, i;
+    char *tok;
+
+    for (tok = strtok(s, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        for (i = 0; i < PATH_NR; i++)
+            if (strcmp(tok, path_name[i]) == 0)
+                mask |= 1 << i;
+        if (strcmp(tok, "all") == 0)
+            mask = (1 << PATH_NR) - 1;
+    }
+    return mask;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-d dev] [-t threads] [-n ops] [-s min:max] [-p write,read,sync,direct,batch|all]\n"
+            "          [-b payload] [-j]\n"
+            "  sizes go from min to max doubling, max defaults to the BRAM size\n"
+            "  -b bytes moved per batch op, in size bytes pwrite()s (default: the BRAM size)\n"
+            "  -j prints JSON instead of CSV\n", prog);
+}
+
+int main(int argc, char **argv) {
+    struct thread *th;
+    size_t size;
+    int opt, i, p, first = 1, ret = 0;
+
+    while ((opt = getopt(argc, argv, "d:t:n:s:p:b:jh")) != -1) {
+        switch (opt) {
+        case 'd': device = optarg; break;
+        case 't': nthreads = atoi(optarg); break;
+        case 'n': iters = atoi(optarg); break;
+        case 's':
+            size_min = strtoul(optarg, &optarg, 0);
+            if (*optarg == ':')
+                size_max = strtoul(optarg + 1, NULL, 0);
+            break;
+        case 'p': paths = parse_paths(optarg); break;
+        case 'b': payload = strtoul(optarg, NULL, 0); break;
+        case 'j': json = 1; break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (nthreads < 1 || iters < 1 || size_min < 1 || !paths) {
+        usage(argv[0]);
+        return 1;
+    }
+    page_size = sysconf(_SC_PAGESIZE);
+
+    th = calloc(nthreads, sizeof(*th));
+    if (th == NULL)
+        die("calloc", ENOMEM);
+    for (i = 0; i < nthreads; i++) {
+        th[i].fd = open(device, O_RDWR);
+        if (th[i].fd < 0) {
+            perror(device);
+            return 1;
+        }
+        if (i == 0) {
+            off_t end = lseek(th[i].fd, 0, SEEK_END);
+
+            if (end < 0)
+                die("lseek", errno);
+            if (end == 0)
+                die(device, ENOSPC);         /* no BRAM behind it */
+            bram_size = end;
+        }
+        th[i].staging = mmap(NULL, bram_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                             th[i].fd, MCHAR_MMAP_STAGING);
+        if (th[i].staging == MAP_FAILED) {
+            perror("mmap");
+            return 1;
+        }
+        /* only the direct path needs the BRAM itself */
+        th[i].bram = NULL;
+        if (paths & (1 << PATH_DIRECT)) {
+            th[i].bram = mmap(NULL, bram_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                              th[i].fd, MCHAR_MMAP_BRAM_WC);
+            if (th[i].bram == MAP_FAILED) {
+                perror("mmap of the BRAM");
+                return 1;
+            }
+        }
+        th[i].buf = xmalloc(bram_size);
+        th[i].lat = xmalloc(iters * sizeof(uint64_t));
+        memset(th[i].buf, 0x5a, bram_size);
+    }
+    if (size_max == 0 || size_max > bram_size)
+        size_max = bram_size;
+    if (payload == 0 || payload > bram_size)
+        payload = bram_size;
+    pthread_barrier_init(&start_line, NULL, nthreads + 1);
+
+    if (round_trip(&th[0]) < 0)
+        return 1;
+    fprintf(stderr, "%s: %zu bytes, round trip ok\n", device, bram_size);
+
+    if (json) {
+        printf("[\n");
+        json_open = 1;
+    } else
+        printf("path,bytes,threads,ops,MBps,ops_per_s,p50_ns,p90_ns,p99_ns,max_ns\n");
+    for (p = 0; p < PATH_NR && ret == 0; p++) {
+        if (!(paths & (1 << p)))
+            continue;
+        for (size = size_min; size <= size_max; size *= 2) {
+            if (run(th, p, size, first) < 0) {
+                ret = 1;            /* on stderr, the output stays valid */
+                break;
+            }
+            first = 0;
+        }
+    }
+    if (json)
+        printf("%s]\n", first ? "" : "\n");
+
+    for (i = 0; i < nthreads; i++) {
+        munmap(th[i].staging, bram_size);
+        if (th[i].bram)
+            munmap(th[i].bram, bram_size);
+        close(th[i].fd);
+        free(th[i].buf);
+        free(th[i].lat);
+    }
+    free(th);
+    return ret;
+}
@@ -9,6 +9,17 @@
  * 
  *  $ make clean ; make ; sudo insmod mmap_myHW.ko
  * 
+ * The BRAM is a platform device: base and size come from the reg of its
+ * device tree node, and it is mapped once when the node is probed:
+ *
+ *    bram@40000000 {
+ *        compatible = "ldd3,mchar-bram";
+ *        reg = <0x40000000 0x2000>;
+ *    };
+ *
+ * without the FPGA (any Linux box) bram_model.ko provides a software BRAM:
+ *  $ sudo insmod bram_model.ko size=8192 access_ns=10 ; sudo insmod mmap_myHW.ko
+ * 
  * 
  * Author  :   Sergio Rivera <srivera@alumnos.upm.es>
  * Date    :   May 2019
@@ -23,77 +34,488 @@
 #include <linux/init.h> 
 #include <linux/fs.h> 
 #include <linux/mm.h> 
+#include <linux/moduleparam.h>
+#include <linux/math64.h>
+#include <linux/platform_device.h>
+#include <linux/of.h>
+#include <linux/sched/signal.h>
+#include <linux/vmalloc.h>
+#include <linux/pagemap.h>
+#include <linux/rmap.h>
+#include <linux/delay.h>
+#include <asm/unaligned.h>
 #include <asm/uaccess.h>
 #include <asm/io.h>
 
-#define MAX_SIZE ( PAGE_SIZE * 10 )   /* max size mmaped to userspace ;
-                                         if PAGE_SIZE == 4094,
-                                              1MB = PAGE_SIZE * 200 + 1 */
+#include "mmap_myHW.h"
+#include "xfer_hist.h"
+
+#define STAGING_MAX_SIZE    MCHAR_MMAP_WINDOW   /* max size mmaped to userspace */
 #define DEVICE_NAME "mchar"
 #define  CLASS_NAME "mogu"
 
 
-#define BRAM_BASE_ADDRESS           0x40000000
+#define BRAM_SIZE                   0x2000      /* 8 KB, see HW/ *_BRAM_project.tcl */
+#define BRAM_DRIVER_NAME            MCHAR_BRAM_DRIVER_NAME
+#define BRAM_BENCH_LOOPS            100
 
 union data {
     int u;
     char c[4]; // sizeof(int)
 };
-union datas {
-    unsigned u[MAX_SIZE];
-    char c[sizeof(unsigned)*MAX_SIZE];
-};
 
 static struct class*  class;
 static struct device*  device;
 static int major;
-static char *sh_mem = NULL; 
 
-static DEFINE_MUTEX(mchar_mutex);
+/* every open() of /dev/mchar is a session with its own staging buffer,
+ * several sessions share the BRAM through bram_acquire()/bram_release()
+ */
+struct mchar_session {
+    char *sh_mem;           /* staging buffer, mmaped at MCHAR_MMAP_STAGING */
+    size_t size;
+    unsigned int nr_pages;
+    struct page **pages;    /* sh_mem is the vmap() of these pages */
+    unsigned long *dirty;   /* pages written through mmap since last sync */
+};
 
-/* copy from kernel space alocated memory to BRAM.
+/* size of the staging buffer of every session, 0 means the BRAM size.
+ * It is built from single pages, so it can be many MB without needing
+ * physically contiguous memory. Nothing past the BRAM can be addressed
+ * (mchar_limit()), so it is clamped to the BRAM size when that is known.
+ */
+static unsigned long staging_size = 0;
+module_param(staging_size, ulong, S_IRUGO);
+MODULE_PARM_DESC(staging_size, "bytes of staging buffer per open (default and max: BRAM size)");
+
+/* BRAM access is granted in FIFO order: a session waiting for the BRAM
+ * queues a bram_waiter and the releasing one hands the BRAM directly to
+ * the oldest waiter, so nobody can be overtaken.
+ */
+struct bram_waiter {
+    struct list_head node;
+    struct task_struct *task;
+    bool granted;
+};
+
+static LIST_HEAD(bram_queue);
+static DEFINE_SPINLOCK(bram_lock);
+static bool bram_busy = false;
+
+/* the BRAM aperture, mapped for the whole life of the platform device */
+static void __iomem *bram_regs = NULL;
+static phys_addr_t bram_phys;
+static size_t bram_size;
+static bool bram_is_ram;     /* software BRAM: map it cached like any other RAM */
+static unsigned int bram_access_ns;     /* modelled bus latency per word */
+static struct module *bram_owner;       /* bram_model.ko, if that is the BRAM */
+
+static struct xfer_hist_set mchar_hist;     /* debugfs: mchar/{read,write,reset} */
+
+/* copy engines used by bram_write()/bram_read(), selected at load time with
+ *  $ sudo insmod mmap_myHW.ko copy_mode=N
+ *
+ * or later, as root (values out of range are refused with EINVAL):
+ *  # echo N > /sys/module/mmap_myHW/parameters/copy_mode
  *
+ *  0: BRAM_COPY_LEGACY  byte by byte through union data, one iowrite32 per word
+ *  1: BRAM_COPY_WORD32  aligned 32 bit words
+ *  2: BRAM_COPY_WORD64  aligned 64 bit words (32 bit words on 32 bit kernels)
+ *  3: BRAM_COPY_IO      memcpy_toio()/memcpy_fromio(), i.e. whatever the arch
+ *                       provides (NEON/SSE width on arm64/x86, but plain bytes
+ *                       on 32 bit arm, so do not use it on the PYNQ)
+ *
+ * All but the legacy loop handle lengths and BRAM offsets that are not
+ * multiple of 4 with a read-modify-write of the first/last word, so the
+ * PL never sees a sub-word access.
  */
-static void bram_write(int len)
+#define BRAM_COPY_LEGACY    0
+#define BRAM_COPY_WORD32    1
+#define BRAM_COPY_WORD64    2
+#define BRAM_COPY_IO        3
+#define BRAM_COPY_NR        4
+
+static int copy_mode = BRAM_COPY_WORD64;
+
+/* it can be changed at any time through /sys/module/mmap_myHW/parameters,
+ * so a bad value is refused here instead of indexing past the engines
+ */
+static int copy_mode_set(const char *val, const struct kernel_param *kp)
+{
+    int mode, ret;
+
+    ret = kstrtoint(val, 0, &mode);
+    if (ret)
+        return ret;
+    if (mode < 0 || mode >= BRAM_COPY_NR)
+        return -EINVAL;
+    WRITE_ONCE(copy_mode, mode);
+    return 0;
+}
+
+static const struct kernel_param_ops copy_mode_ops = {
+    .set = copy_mode_set,
+    .get = param_get_int,
+};
+
+module_param_cb(copy_mode, &copy_mode_ops, &copy_mode, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(copy_mode, "BRAM copy engine: 0 legacy, 1 word32, 2 word64, 3 memcpy_toio");
+
+static bool bench_on_load = false;
+module_param(bench_on_load, bool, S_IRUGO);
+MODULE_PARM_DESC(bench_on_load, "time every copy engine against the BRAM when loading");
+
+static const char * const copy_mode_name[BRAM_COPY_NR] = {
+    "legacy", "word32", "word64", "memcpy_io",
+};
+
+/* merge n (< 4) bytes into the BRAM word that holds dst */
+static void bram_rmw_to(void __iomem *dst, const char *src, size_t n)
+{
+    unsigned long head = (unsigned long)dst & 3;
+    void __iomem *word = dst - head;
+    u32 x = __raw_readl(word);
+
+    memcpy((char *)&x + head, src, n);
+    __raw_writel(x, word);
+}
+
+static void bram_rmw_from(char *dst, const void __iomem *src, size_t n)
+{
+    unsigned long head = (unsigned long)src & 3;
+    u32 x = __raw_readl(src - head);
+
+    memcpy(dst, (char *)&x + head, n);
+}
+
+static void bram_copy_legacy_to(void __iomem *regs, const char *src, size_t len)
 {
     union data x;
-    x.u=0;
-    void __iomem *regs = ioremap_nocache(BRAM_BASE_ADDRESS,0x40);
     int i = 0;
     while(i < len/4) {
       x.u=0;
-      x.c[0] = *( sh_mem + 4 * i + 0 );
-      x.c[1] = *( sh_mem + 4 * i + 1 );
-      x.c[2] = *( sh_mem + 4 * i + 2 );
-      x.c[3] = *( sh_mem + 4 * i + 3 );
+      x.c[0] = *( src + 4 * i + 0 );
+      x.c[1] = *( src + 4 * i + 1 );
+      x.c[2] = *( src + 4 * i + 2 );
+      x.c[3] = *( src + 4 * i + 3 );
       iowrite32(x.u ,regs+i*4);
       i++;
     }
-    iounmap(BRAM_BASE_ADDRESS);
-
 }
 
-/* copy from BRAM to kernel space alocated memory.
- *
- */
-static void bram_read(int len)
+static void bram_copy_legacy_from(char *dst, void __iomem *regs, size_t len)
 {
     union data x;
-    x.u=0;
-    void __iomem *regs = ioremap_nocache(BRAM_BASE_ADDRESS,0x4);
     int i = 0;
     while(i < len/4) {
       x.u=(u32)ioread32(regs+i*4);
-      *( sh_mem + 4 * i + 0 ) = x.c[0];
-      *( sh_mem + 4 * i + 1 ) = x.c[1];
-      *( sh_mem + 4 * i + 2 ) = x.c[2];
-      *( sh_mem + 4 * i + 3 ) = x.c[3];
+      *( dst + 4 * i + 0 ) = x.c[0];
+      *( dst + 4 * i + 1 ) = x.c[1];
+      *( dst + 4 * i + 2 ) = x.c[2];
+      *( dst + 4 * i + 3 ) = x.c[3];
       i++;
     }
-    iounmap(BRAM_BASE_ADDRESS);
+}
+
+/* copy len bytes of src to the BRAM at dst with the given engine.
+ * The word loops use the __raw accessors and a single barrier per call
+ * instead of one barrier per iowrite32().
+ */
+static void bram_copy_to(int mode, void __iomem *dst, const char *src, size_t len)
+{
+    size_t n;
+
+    if (mode == BRAM_COPY_LEGACY) {
+        bram_copy_legacy_to(dst, src, len);
+        return;
+    }
+    if (mode == BRAM_COPY_IO) {
+        memcpy_toio(dst, src, len);
+        return;
+    }
+
+    wmb();
+    n = min_t(size_t, len, (4 - ((unsigned long)dst & 3)) & 3);
+    if (n) {
+        bram_rmw_to(dst, src, n);
+        dst += n; src += n; len -= n;
+    }
+#ifdef CONFIG_64BIT
+    if (mode == BRAM_COPY_WORD64) {
+        if (len >= 4 && ((unsigned long)dst & 7)) {
+            __raw_writel(get_unaligned((const u32 *)src), dst);
+            dst += 4; src += 4; len -= 4;
+        }
+        while (len >= 8) {
+            __raw_writeq(get_unaligned((const u64 *)src), dst);
+            dst += 8; src += 8; len -= 8;
+        }
+    }
+#endif
+    while (len >= 4) {
+        __raw_writel(get_unaligned((const u32 *)src), dst);
+        dst += 4; src += 4; len -= 4;
+    }
+    if (len)
+        bram_rmw_to(dst, src, len);
+    wmb();
+}
+
+/* copy len bytes of the BRAM at src to dst with the given engine */
+static void bram_copy_from(int mode, char *dst, void __iomem *src, size_t len)
+{
+    size_t n;
+
+    if (mode == BRAM_COPY_LEGACY) {
+        bram_copy_legacy_from(dst, src, len);
+        return;
+    }
+    if (mode == BRAM_COPY_IO) {
+        memcpy_fromio(dst, src, len);
+        return;
+    }
+
+    n = min_t(size_t, len, (4 - ((unsigned long)src & 3)) & 3);
+    if (n) {
+        bram_rmw_from(dst, src, n);
+        dst += n; src += n; len -= n;
+    }
+#ifdef CONFIG_64BIT
+    if (mode == BRAM_COPY_WORD64) {
+        if (len >= 4 && ((unsigned long)src & 7)) {
+            put_unaligned(__raw_readl(src), (u32 *)dst);
+            dst += 4; src += 4; len -= 4;
+        }
+        while (len >= 8) {
+            put_unaligned(__raw_readq(src), (u64 *)dst);
+            dst += 8; src += 8; len -= 8;
+        }
+    }
+#endif
+    while (len >= 4) {
+        put_unaligned(__raw_readl(src), (u32 *)dst);
+        dst += 4; src += 4; len -= 4;
+    }
+    if (len)
+        bram_rmw_from(dst, src, len);
+    rmb();
+}
+
+/* software BRAM: stall as the AXI bus would, bram_access_ns per word.
+ * Only the copies done here pay it, not the mmap of the BRAM itself
+ */
+static void bram_model_delay(size_t len)
+{
+    u64 ns;
+
+    if (!bram_access_ns)
+        return;
+    ns = (u64)DIV_ROUND_UP(len, 4) * bram_access_ns;
+    if (ns < 20 * NSEC_PER_USEC)
+        ndelay(ns);
+    else
+        usleep_range(div_u64(ns, NSEC_PER_USEC), div_u64(ns, NSEC_PER_USEC) + 1);
+}
+
+/* the legacy loop only moves whole, aligned words */
+static int bram_copy_mode(loff_t pos, int len)
+{
+    int mode = READ_ONCE(copy_mode);
+
+    if (mode == BRAM_COPY_LEGACY && ((pos | len) & 3))
+        return BRAM_COPY_WORD32;
+    return mode;
+}
+
+/* wait (interruptible) for our turn to use the BRAM */
+static int bram_acquire(void)
+{
+    struct bram_waiter w = { .task = current, .granted = false };
+    int ret = 0;
+
+    spin_lock(&bram_lock);
+    if (!bram_busy) {
+        bram_busy = true;
+        spin_unlock(&bram_lock);
+        return 0;
+    }
+
+    list_add_tail(&w.node, &bram_queue);
+    for (;;) {
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (w.granted)
+            break;
+        if (signal_pending(current)) {
+            list_del(&w.node);
+            ret = -ERESTARTSYS;
+            break;
+        }
+        spin_unlock(&bram_lock);
+        schedule();
+        spin_lock(&bram_lock);
+    }
+    __set_current_state(TASK_RUNNING);
+    spin_unlock(&bram_lock);
+
+    return ret;
+}
+
+/* hand the BRAM to the oldest waiter, if any */
+static void bram_release(void)
+{
+    struct bram_waiter *next;
+
+    spin_lock(&bram_lock);
+    next = list_first_entry_or_null(&bram_queue, struct bram_waiter, node);
+    if (next != NULL) {
+        list_del(&next->node);
+        next->granted = true;
+        wake_up_process(next->task);
+    } else {
+        bram_busy = false;
+    }
+    spin_unlock(&bram_lock);
+}
+
+/* copy from kernel space alocated memory to BRAM.
+ *
+ */
+static int bram_write(struct mchar_session *sess, loff_t pos, int len)
+{
+    int ret = bram_acquire();
+    u64 t0;
+
+    if (ret)
+        return ret;
+    t0 = ktime_get_ns();
+    bram_copy_to(bram_copy_mode(pos, len), bram_regs + pos, sess->sh_mem + pos, len);
+    bram_model_delay(len);
+    xfer_hist_add(&mchar_hist, XFER_WRITE, ktime_get_ns() - t0, len);
+    bram_release();
+    return 0;
+}
+
+/* copy from BRAM to kernel space alocated memory.
+ *
+ */
+static int bram_read(struct mchar_session *sess, loff_t pos, int len)
+{
+    int ret = bram_acquire();
+    u64 t0;
+
+    if (ret)
+        return ret;
+    t0 = ktime_get_ns();
+    bram_copy_from(bram_copy_mode(pos, len), sess->sh_mem + pos, bram_regs + pos, len);
+    bram_model_delay(len);
+    xfer_hist_add(&mchar_hist, XFER_READ, ktime_get_ns() - t0, len);
+    bram_release();
+    return 0;
+}
+
+/* time every copy engine over the whole BRAM (bench_on_load=1).
+ * The legacy loop is the reference the others are compared with.
+ * BRAM contents are lost.
+ */
+static void bram_bench(void)
+{
+    void __iomem *regs = bram_regs;
+    size_t len = bram_size;
+    u64 t0, tw, tr, ref_w = 0, ref_r = 0;
+    int mode, i;
+    char *sh_mem = vmalloc(len);
+
+    if (sh_mem == NULL)
+        return;
+    for (i = 0; i < len; i++)
+        sh_mem[i] = i;
+
+    for (mode = 0; mode < BRAM_COPY_NR; mode++) {
+        t0 = ktime_get_ns();
+        for (i = 0; i < BRAM_BENCH_LOOPS; i++)
+            bram_copy_to(mode, regs, sh_mem, len);
+        tw = ktime_get_ns() - t0;
+
+        t0 = ktime_get_ns();
+        for (i = 0; i < BRAM_BENCH_LOOPS; i++)
+            bram_copy_from(mode, sh_mem, regs, len);
+        tr = ktime_get_ns() - t0;
+
+        if (mode == BRAM_COPY_LEGACY) {
+            ref_w = tw;
+            ref_r = tr;
+        }
+        /* bytes/ns * 1000 == MB/s */
+        pr_info("mchar: bench %-9s write %5llu MB/s (x%llu.%02llu)  read %5llu MB/s (x%llu.%02llu)\n",
+                copy_mode_name[mode],
+                div64_u64((u64)len * BRAM_BENCH_LOOPS * 1000, tw ?: 1),
+                div64_u64(ref_w, tw ?: 1), div64_u64(ref_w * 100, tw ?: 1) % 100,
+                div64_u64((u64)len * BRAM_BENCH_LOOPS * 1000, tr ?: 1),
+                div64_u64(ref_r, tr ?: 1), div64_u64(ref_r * 100, tr ?: 1) % 100);
+    }
+    vfree(sh_mem);
+}
+
+
+static void staging_free(struct mchar_session *sess)
+{
+    unsigned int i;
+
+    if (sess->sh_mem != NULL)
+        vunmap(sess->sh_mem);
+    for (i = 0; sess->pages != NULL && i < sess->nr_pages; i++) {
+        if (sess->pages[i] != NULL) {
+            sess->pages[i]->mapping = NULL;
+            ClearPageDirty(sess->pages[i]);
+            __free_page(sess->pages[i]);
+        }
+    }
+    kvfree(sess->pages);
+    kvfree(sess->dirty);
+}
+
+/* allocate the staging buffer page by page and vmap it, so the
+ * copy engines still see a linear buffer
+ */
+static int staging_alloc(struct mchar_session *sess, size_t size)
+{
+    unsigned int i;
+
+    sess->size = PAGE_ALIGN(size);
+    sess->nr_pages = sess->size >> PAGE_SHIFT;
+    sess->pages = kvmalloc_array(sess->nr_pages, sizeof(struct page *), GFP_KERNEL | __GFP_ZERO);
+    sess->dirty = kvmalloc_array(BITS_TO_LONGS(sess->nr_pages), sizeof(long), GFP_KERNEL | __GFP_ZERO);
+    if (sess->pages == NULL || sess->dirty == NULL)
+        goto fail;
+
+    for (i = 0; i < sess->nr_pages; i++) {
+        sess->pages[i] = alloc_page(GFP_KERNEL | __GFP_ZERO);
+        if (sess->pages[i] == NULL)
+            goto fail;
+    }
+    sess->sh_mem = vmap(sess->pages, sess->nr_pages, VM_MAP, PAGE_KERNEL);
+    if (sess->sh_mem == NULL)
+        goto fail;
+    return 0;
 
+fail:
+    staging_free(sess);
+    return -ENOMEM;
 }
 
+/* the staging pages are not page cache, do not let the default
+ * set_page_dirty() tag them in the device inode radix tree
+ */
+static int mchar_set_page_dirty(struct page *page)
+{
+    if (!PageDirty(page))
+        SetPageDirty(page);
+    return 0;
+}
+
+static const struct address_space_operations mchar_aops = {
+    .set_page_dirty = mchar_set_page_dirty,
+};
 
 /*  executed once the device is closed or releaseed by userspace
  *  @param inodep: pointer to struct inode
@@ -101,82 +523,178 @@ static void bram_read(int len)
  */
 static int mchar_release(struct inode *inodep, struct file *filep)
 {    
-    mutex_unlock(&mchar_mutex);
+    struct mchar_session *sess = filep->private_data;
+
+    staging_free(sess);
+    kfree(sess);
+    module_put(bram_owner);
     pr_info("mchar: Device successfully closed\n");
 
     return 0;
 }
 
 /* executed once the device is opened.
- *
+ * Any number of processes may have it open, each one gets a session.
  */
 static int mchar_open(struct inode *inodep, struct file *filep)
 {
     int ret = 0; 
+    struct mchar_session *sess;
 
-    if(!mutex_trylock(&mchar_mutex)) {
-        pr_alert("mchar: device busy!\n");
-        ret = -EBUSY;
+    /* a software BRAM must not go away under an open session */
+    if (!try_module_get(bram_owner)) {
+        ret = -ENODEV;
+        goto out;
+    }
+    sess = kzalloc(sizeof(*sess), GFP_KERNEL);
+    if (sess == NULL) {
+        module_put(bram_owner);
+        ret = -ENOMEM;
         goto out;
     }
+    /* init this mmap area */
+    ret = staging_alloc(sess, staging_size ? min_t(size_t, staging_size, bram_size) : bram_size);
+    if (ret) {
+        kfree(sess);
+        module_put(bram_owner);
+        goto out;
+    }
+    filep->private_data = sess;
+    /* see mchar_set_page_dirty() */
+    filep->f_mapping->a_ops = &mchar_aops;
  
     pr_info("mchar: Device opened\n");
-    printk("MAX_SIZE: %d \n", MAX_SIZE);
+    printk("staging size: %zu \n", sess->size);
 
 out:
     return ret;
 }
 
+/*  map the BRAM physical range itself to user space (zero-copy)
+ *  @param off: offset inside the BRAM
+ *  @param wc: write-combining instead of uncached
+ */
+static int mchar_mmap_bram(struct vm_area_struct *vma, unsigned long off, bool wc)
+{
+    unsigned long size = vma->vm_end - vma->vm_start;
+
+    if (!PAGE_ALIGNED(bram_phys) || off + size > PAGE_ALIGN(bram_size))
+        return -EINVAL;
+
+    if (!bram_is_ram)
+        vma->vm_page_prot = wc ? pgprot_writecombine(vma->vm_page_prot)
+                               : pgprot_noncached(vma->vm_page_prot);
+    vma->vm_flags |= VM_IO | VM_DONTEXPAND | VM_DONTDUMP;
+
+    return io_remap_pfn_range(vma, vma->vm_start, (bram_phys + off) >> PAGE_SHIFT,
+                              size, vma->vm_page_prot);
+}
+
+/* the staging pages are inserted one by one as user space touches them.
+ * As in fb_defio, they point to the file mapping so that page_mkclean()
+ * can find and write protect them again after a sync.
+ */
+static int mchar_vm_fault(struct vm_fault *vmf)
+{
+    struct mchar_session *sess = vmf->vma->vm_private_data;
+    struct page *page;
+
+    if (vmf->pgoff >= sess->nr_pages)
+        return VM_FAULT_SIGBUS;
+
+    page = sess->pages[vmf->pgoff];
+    get_page(page);
+    page->mapping = vmf->vma->vm_file->f_mapping;
+    page->index = vmf->pgoff;
+    vmf->page = page;
+    return 0;
+}
+
+/* the first store to a clean page lands here: remember it for the next sync */
+static int mchar_vm_mkwrite(struct vm_fault *vmf)
+{
+    struct mchar_session *sess = vmf->vma->vm_private_data;
+    struct page *page = vmf->page;
+
+    lock_page(page);
+    set_bit(page->index, sess->dirty);
+    return VM_FAULT_LOCKED;
+}
+
+static const struct vm_operations_struct mchar_vm_ops = {
+    .fault = mchar_vm_fault,
+    .page_mkwrite = mchar_vm_mkwrite,
+};
+
+
 /*  mmap handler to map kernel space to user space  
- *
+ *  the offset selects the staging buffer or the BRAM, see mmap_myHW.h
  */
 static int mchar_mmap(struct file *filp, struct vm_area_struct *vma)
 {
+    struct mchar_session *sess = filp->private_data;
     int ret = 0;
-    struct page *page = NULL;
     unsigned long size = (unsigned long)(vma->vm_end - vma->vm_start);
+    unsigned long off = vma->vm_pgoff << PAGE_SHIFT;
 
-    if (size > MAX_SIZE) {
+    if (off >= MCHAR_MMAP_BRAM_WC)
+        return mchar_mmap_bram(vma, off - MCHAR_MMAP_BRAM_WC, true);
+    if (off >= MCHAR_MMAP_BRAM_UC)
+        return mchar_mmap_bram(vma, off - MCHAR_MMAP_BRAM_UC, false);
+
+    if (off + size > sess->size) {
         ret = -EINVAL;
         goto out;  
     } 
-   
-    page = virt_to_page((unsigned long)sh_mem + (vma->vm_pgoff << PAGE_SHIFT)); 
-    ret = remap_pfn_range(vma, vma->vm_start, page_to_pfn(page), size, vma->vm_page_prot);
-    if (ret != 0) {
+
+    /* stores to COW copies would never mark the staging pages dirty */
+    if (!(vma->vm_flags & VM_SHARED)) {
+        ret = -EINVAL;
         goto out;
-    }   
+    }
+
+    vma->vm_ops = &mchar_vm_ops;
+    vma->vm_private_data = sess;
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
 
 out:
     return ret;
 }
 
+/* bytes addressable through read()/write()/lseek() */
+static loff_t mchar_limit(struct mchar_session *sess)
+{
+    return min_t(loff_t, sess->size, bram_size);
+}
+
+/* SEEK_SET/CUR/END inside [0, BRAM size]; pread()/pwrite() need nothing else */
+static loff_t mchar_llseek(struct file *filep, loff_t offset, int whence)
+{
+    struct mchar_session *sess = filep->private_data;
+
+    return fixed_size_llseek(filep, offset, whence, mchar_limit(sess));
+}
+
 static ssize_t mchar_read(struct file *filep, char *buffer, size_t len, loff_t *offset)
 {
+    struct mchar_session *sess = filep->private_data;
+    loff_t pos = *offset;
     int ret;
-    printk(KERN_ALERT "bram_read()....");
-    struct timespec begin, end, diff;
-    getnstimeofday (&begin);
 
-    bram_read(len);          // <----------------------------
-
-    getnstimeofday (&end);
-    diff = timespec_sub(end, begin);
-    if (diff.tv_sec > 0)
-        printk ("bram_read(%d bytes), read time (ns): %lu\"%lu,", len, diff.tv_sec, diff.tv_nsec );
-    else
-        printk ("bram_read(%d bytes), read time (ns): %lu", len, diff.tv_nsec);
+    /* the staging buffer mirrors the BRAM: same offset in both */
+    if (pos >= mchar_limit(sess))
+        return 0;
+    if (len > mchar_limit(sess) - pos)
+        len = mchar_limit(sess) - pos;
 
-    if (len > MAX_SIZE) {
-        printk(KERN_ALERT "read overflow!\n");
-        printk(KERN_ALERT "please, increase max size mmaped to userspace!\n");
-        ret = -EFAULT;
+    /* timed into the read histogram, see xfer_hist.h */
+    ret = bram_read(sess, pos, len);          // <----------------------------
+    if (ret)
         goto out;
-    }
 
-    if (raw_copy_to_user(buffer, sh_mem, len) == 0) {
-        pr_info("mchar: copy %u char to the user\n", len);
+    if (raw_copy_to_user(buffer, sess->sh_mem + pos, len) == 0) {
         ret = len;
+        *offset = pos + len;
 
     } else {
         ret =  -EFAULT;   
@@ -188,45 +706,210 @@ out:
 
 static ssize_t mchar_write(struct file *filep, const char *buffer, size_t len, loff_t *offset)
 {
+    struct mchar_session *sess = filep->private_data;
+    loff_t pos = *offset;
     int ret;
     
-    
-    if (raw_copy_from_user(sh_mem, buffer, len)) {
+    if (pos >= mchar_limit(sess)) {
+        ret = -ENOSPC;      /* end of the BRAM, nothing worth a log line */
+        goto out;
+    }
+    if (len > mchar_limit(sess) - pos)
+        len = mchar_limit(sess) - pos;
+
+    if (raw_copy_from_user(sess->sh_mem + pos, buffer, len)) {
         pr_err("mchar: write fault!\n");
         ret = -EFAULT;
         goto out;
     }
 
-    pr_info("mchar: copy %d char from the user\n", len);
+    /* timed into the write histogram, see xfer_hist.h */
+    ret = bram_write(sess, pos, len);          // <----------------------------
+    if (ret)
+        goto out;
     ret = len;
+    *offset = pos + len;
 
-    printk(KERN_ALERT "bram_write()....");
-    struct timespec begin, end, diff;
-    getnstimeofday (&begin);
+out:
+    return ret;
+}
 
-    bram_write(len);          // <----------------------------
+/* copy the dirty staging pages that [pos, pos + len) touches to the BRAM.
+ * Whole pages go (only clipped at mchar_limit()): their dirty bit is gone
+ * afterwards, so bytes of them outside the range would never be synced.
+ * Every dirty page is write protected again before being copied, so a
+ * store racing with the copy faults and marks it dirty for the next sync.
+ * Contiguous dirty pages are copied with a single bram_copy_to().
+ */
+static long mchar_sync(struct mchar_session *sess, loff_t pos, u64 len)
+{
+    loff_t limit = mchar_limit(sess);
+    unsigned long first, last, start, end, i;
+    size_t from, n;
+    long done = 0;
+    u64 t0;
+    int ret;
 
-    getnstimeofday (&end);
-    diff = timespec_sub(end, begin);
-    if (diff.tv_sec > 0)
-        printk ("bram_write(%d bytes), write time (ns): %lu\"%lu,", len, diff.tv_sec, diff.tv_nsec );
-    else
-        printk ("bram_write(%d bytes), write time (ns): %lu,", len, diff.tv_nsec );
+    if (pos < 0)
+        return -EINVAL;
+    if (pos >= limit)
+        return 0;
+    if (len == 0 || len > limit - pos)
+        len = limit - pos;
+    first = pos >> PAGE_SHIFT;
+    last = DIV_ROUND_UP(pos + len, PAGE_SIZE);
+
+    ret = bram_acquire();
+    if (ret)
+        return ret;
+
+    t0 = ktime_get_ns();
+    start = find_next_bit(sess->dirty, last, first);
+    while (start < last) {
+        end = find_next_zero_bit(sess->dirty, last, start);
+        for (i = start; i < end; i++) {
+            struct page *page = sess->pages[i];
+
+            lock_page(page);
+            if (test_and_clear_bit(i, sess->dirty) && page->mapping != NULL)
+                page_mkclean(page);
+            unlock_page(page);
+        }
+
+        from = (loff_t)start << PAGE_SHIFT;
+        n = min_t(loff_t, (loff_t)end << PAGE_SHIFT, limit) - from;
+        bram_copy_to(bram_copy_mode(from, n), bram_regs + from, sess->sh_mem + from, n);
+        bram_model_delay(n);
+        done += n;
+
+        start = find_next_bit(sess->dirty, last, end);
+    }
+    xfer_hist_add(&mchar_hist, XFER_WRITE, ktime_get_ns() - t0, done);
+    bram_release();
 
+    return done;
+}
 
-out:
-    return ret;
+/*
+ * The ioctl() implementation
+ */
+static long mchar_ioctl(struct file *filep, unsigned int cmd, unsigned long arg)
+{
+    struct mchar_session *sess = filep->private_data;
+    struct mchar_range range;
+    unsigned long first, last;
+
+    if (_IOC_TYPE(cmd) != MCHAR_IOC_MAGIC || _IOC_NR(cmd) > MCHAR_IOC_MAXNR)
+        return -ENOTTY;
+
+    if (copy_from_user(&range, (void __user *)arg, sizeof(range)))
+        return -EFAULT;
+
+    switch (cmd) {
+    case MCHAR_IOC_SYNC:
+        return mchar_sync(sess, range.offset, range.len);
+
+    case MCHAR_IOC_MARK_DIRTY:
+        if (range.offset >= sess->size || range.len > sess->size - range.offset)
+            return -EINVAL;
+        first = range.offset >> PAGE_SHIFT;
+        last = DIV_ROUND_UP(range.offset + range.len, PAGE_SIZE);
+        bitmap_set(sess->dirty, first, last - first);
+        return 0;
+
+    default:
+        return -ENOTTY;
+    }
 }
 
 static const struct file_operations mchar_fops = {
     .open = mchar_open,
+    .llseek = mchar_llseek,
     .read = mchar_read,
     .write = mchar_write,
     .release = mchar_release,
     .mmap = mchar_mmap,
+    .unlocked_ioctl = mchar_ioctl,
     .owner = THIS_MODULE,
 };
 
+/* the char device only exists while a BRAM is bound to the driver */
+static int mchar_probe(struct platform_device *pdev)
+{
+    struct mchar_bram_pdata *pdata = dev_get_platdata(&pdev->dev);
+    struct resource *res;
+    int ret = 0;
+
+    if (bram_regs != NULL) {
+        dev_err(&pdev->dev, "only one BRAM is supported\n");
+        return -EBUSY;
+    }
+
+    if (pdata != NULL) {
+        /* software BRAM, already kernel memory */
+        bram_regs = (void __iomem *)pdata->vaddr;
+        bram_phys = virt_to_phys(pdata->vaddr);
+        bram_size = pdata->size;
+        bram_is_ram = true;
+        bram_access_ns = pdata->access_ns;
+        bram_owner = pdata->owner;
+    } else {
+        res = platform_get_resource(pdev, IORESOURCE_MEM, 0);
+        bram_regs = devm_ioremap_resource(&pdev->dev, res);
+        if (IS_ERR(bram_regs)) {
+            ret = PTR_ERR(bram_regs);
+            bram_regs = NULL;
+            return ret;
+        }
+        bram_phys = res->start;
+        bram_size = resource_size(res);
+        bram_is_ram = false;
+        bram_access_ns = 0;
+        bram_owner = NULL;
+    }
+    dev_info(&pdev->dev, "BRAM at %pa, %zu bytes\n", &bram_phys, bram_size);
+    if (staging_size > bram_size)
+        dev_warn(&pdev->dev, "staging_size %lu clamped to the BRAM size\n", staging_size);
+
+    device = device_create(class, &pdev->dev, MKDEV(major, 0), NULL, DEVICE_NAME);
+    if (IS_ERR(device)) {
+        ret = PTR_ERR(device);
+        bram_regs = NULL;
+        printk(KERN_ALERT "failed to register device /dev/mchar \n");
+        return ret;
+    }
+
+    if (bench_on_load)
+        bram_bench();
+
+    return 0;
+}
+
+static int mchar_remove(struct platform_device *pdev)
+{
+    device_destroy(class, MKDEV(major, 0));
+    bram_regs = NULL;   /* devm unmaps it */
+    return 0;
+}
+
+static const struct of_device_id mchar_of_match[] = {
+    { .compatible = "ldd3,mchar-bram", },
+    { .compatible = "xlnx,axi-bram-ctrl-4.0", },
+    {}
+};
+MODULE_DEVICE_TABLE(of, mchar_of_match);
+
+static struct platform_driver mchar_driver = {
+    .probe = mchar_probe,
+    .remove = mchar_remove,
+    .driver = {
+        .name = BRAM_DRIVER_NAME,
+        .owner = THIS_MODULE,
+        .of_match_table = mchar_of_match,
+        .suppress_bind_attrs = true,    /* open sessions use bram_regs */
+    },
+};
+
 static int __init mchar_init(void)
 {
     int ret = 0;    
@@ -250,26 +933,28 @@ static int __init mchar_init(void)
         goto out;
     }
 
-    device = device_create(class, NULL, MKDEV(major, 0), NULL, DEVICE_NAME);
-    if (IS_ERR(device)) {
-        class_destroy(class);
-        unregister_chrdev(major, DEVICE_NAME);
-        ret = PTR_ERR(device);
-        printk(KERN_ALERT "failed to register device /dev/mchar \n");
-        goto out;
-    }
+    if (staging_size > STAGING_MAX_SIZE)
+        staging_size = STAGING_MAX_SIZE;
+    pr_info("mchar: copy engine %s\n", copy_mode_name[copy_mode]);
 
-    printk(KERN_INFO "mapping memory to device /dev/mchar \n");
+    ret = xfer_hist_init(&mchar_hist, DEVICE_NAME);
+    if (ret)
+        goto out_class;
 
-    /* init this mmap area */
-    sh_mem = kmalloc(MAX_SIZE, GFP_ATOMIC|GFP_DMA); // GFP_DMA -> contiguous physical memory
-    if (sh_mem == NULL) {
-        ret = -ENOMEM; 
-        goto out;
+    /* /dev/mchar shows up when the BRAM is probed */
+    ret = platform_driver_register(&mchar_driver);
+    if (ret) {
+        printk(KERN_ERR "mchar: platform_driver_register() %s\n", BRAM_DRIVER_NAME);
+        goto out_hist;
     }
-    
-    printk("memory allocated: %d\n", ksize(sh_mem));
-    mutex_init(&mchar_mutex);
+
+    return 0;
+
+out_hist:
+    xfer_hist_exit(&mchar_hist);
+out_class:
+    class_destroy(class);
+    unregister_chrdev(major, DEVICE_NAME);
 out: 
     return ret;
 }
@@ -279,13 +964,11 @@ static void __exit mchar_exit(void)
 
     printk(KERN_INFO "trying to unregister the device /dev/mchar \n");
 
-    mutex_destroy(&mchar_mutex); 
-    device_destroy(class, MKDEV(major, 0));  
-    class_unregister(class);
+    platform_driver_unregister(&mchar_driver);
+    xfer_hist_exit(&mchar_hist);
+
     class_destroy(class); 
     unregister_chrdev(major, DEVICE_NAME);
-    
-    kfree(sh_mem);
 
     pr_info("mchar: unregistered!");
 }
@@ -0,0 +1,70 @@
+#ifndef _MMAP_MYHW_H_
+#define _MMAP_MYHW_H_
+
+/*
+ * Definitions shared by mmap_myHW.c and the user space programs
+ *
+ * Author  :   Sergio Rivera <srivera@alumnos.upm.es>
+ */
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define MCHAR_DEVICE_FILENAME "/dev/mchar"
+
+/*
+ * mmap() offsets: the offset passed to mmap selects what gets mapped
+ *
+ *  MCHAR_MMAP_STAGING  the kernel staging buffer that read()/write() copy
+ *                      to/from the BRAM
+ *  MCHAR_MMAP_BRAM_UC  the BRAM itself, uncached (every load/store is one
+ *                      access to the PL)
+ *  MCHAR_MMAP_BRAM_WC  the BRAM itself, write-combining (stores may be
+ *                      merged into bursts, loads are not cached)
+ *
+ * The BRAM windows are zero-copy: stores reach the PL without any syscall.
+ * The page offset inside a window is the offset inside the BRAM.
+ */
+#define MCHAR_MMAP_STAGING  0x00000000
+#define MCHAR_MMAP_BRAM_UC  0x10000000
+#define MCHAR_MMAP_BRAM_WC  0x20000000
+#define MCHAR_MMAP_WINDOW   0x10000000   /* size of every window */
+
+/*
+ * Ioctl definitions
+ *
+ * Stores through the MCHAR_MMAP_STAGING mapping are tracked per page.
+ * MCHAR_IOC_SYNC copies to the BRAM only the pages written since the last
+ * sync (len == 0 means up to the end) and returns the bytes copied. Dirty
+ * pages the range touches are copied whole. The mapping must be MAP_SHARED.
+ * MCHAR_IOC_MARK_DIRTY adds a range to the next sync by hand.
+ */
+struct mchar_range {
+    __u64 offset;
+    __u64 len;
+};
+
+#define MCHAR_IOC_MAGIC         'B'
+
+#define MCHAR_IOC_SYNC          _IOW(MCHAR_IOC_MAGIC, 0, struct mchar_range)
+#define MCHAR_IOC_MARK_DIRTY    _IOW(MCHAR_IOC_MAGIC, 1, struct mchar_range)
+
+#define MCHAR_IOC_MAXNR (1)
+
+#ifdef __KERNEL__
+/*
+ * Platform data of a software BRAM (bram_model.ko): plain kernel memory
+ * instead of the PL, and the latency of every 32 bit access to model the
+ * AXI bus. The mchar driver pins owner while /dev/mchar is open.
+ */
+#define MCHAR_BRAM_DRIVER_NAME "mchar-bram"
+
+struct mchar_bram_pdata {
+    void *vaddr;                /* physically contiguous */
+    size_t size;
+    unsigned int access_ns;     /* added per 32 bit word moved, 0 = none */
+    struct module *owner;
+};
+#endif /* __KERNEL__ */
+
+#endif /* _MMAP_MYHW_H_ */
@@ -0,0 +1,179 @@
+/* x86_64 + arm
+ *
+ * Client library of /dev/hwchar, see hwchar_client.h
+ *
+ *  gcc -Wall -O2 -c hwchar_client.c    (link hwchar_client.o in the program)
+ *
+ * Author  :   Sergio Rivera <srivera@alumnos.upm.es>
+ *
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+
+#include "hwchar_client.h"
+
+static size_t module_buf_size(void) {
+    FILE *f = fopen(HWCHAR_BUF_SIZE_PARAM, "r");
+    unsigned long v = 0;
+
+    if (f == NULL)
+        return 0;
+    if (fscanf(f, "%lu", &v) != 1)
+        v = 0;
+    fclose(f);
+    return v;
+}
+
+/* hand a range over to the DMA (to_cpu 0) or back to the CPU */
+static int sync_range(struct hwchar *h, int slot, int dir, size_t len, int to_cpu) {
+    struct hwchar_sync sync;
+
+    sync.offset = (size_t)slot * h->slot_size;
+    sync.len = len;
+    sync.dir = dir;
+    sync.pad = 0;
+    if (ioctl(h->fd, to_cpu ? HWCHAR_IOC_BEGIN_CPU_ACCESS : HWCHAR_IOC_END_CPU_ACCESS, &sync) < 0)
+        return -errno;
+    return 0;
+}
+
+int hwchar_open(struct hwchar *h, const char *dev, size_t size, size_t slot_size) {
+    int ret;
+
+    memset(h, 0, sizeof(*h));
+    if (size == 0)
+        size = module_buf_size();
+    if (slot_size == 0)
+        slot_size = size;
+    if (size == 0 || slot_size > size)
+        return -EINVAL;
+
+    h->fd = open(dev ? dev : HWCHAR_DEVICE_FILENAME, O_RDWR);
+    if (h->fd < 0)
+        return -errno;
+
+    h->mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, h->fd, 0);
+    if (h->mem == MAP_FAILED) {
+        ret = -errno;
+        close(h->fd);
+        return ret;
+    }
+    h->size = size;
+    h->slot_size = slot_size;
+    h->nslots = size / slot_size;
+    if (h->nslots > HWCHAR_QUEUE_DEPTH)
+        h->nslots = HWCHAR_QUEUE_DEPTH;
+    return 0;
+}
+
+void hwchar_close(struct hwchar *h) {
+    hwchar_drain(h);
+    munmap(h->mem, h->size);
+    close(h->fd);
+    h->fd = -1;
+    h->mem = NULL;
+}
+
+int hwchar_submit(struct hwchar *h, int slot, int dir, size_t len) {
+    struct hwchar_job job;
+    int ret;
+
+    if (slot < 0 || slot >= h->nslots || len == 0 || len > h->slot_size || h->slot[slot].busy)
+        return -EINVAL;
+
+    ret = sync_range(h, slot, dir, len, 0);
+    if (ret)
+        return ret;
+
+    job.dir = dir;
+    job.pad = 0;
+    job.offset = (size_t)slot * h->slot_size;
+    job.len = len;
+    job.cookie = slot;
+    if (ioctl(h->fd, HWCHAR_IOC_SUBMIT, &job) < 0)
+        return -errno;
+
+    h->slot[slot].busy = 1;
+    h->slot[slot].dir = dir;
+    h->slot[slot].len = len;
+    h->inflight++;
+    return 0;
+}
+
+int hwchar_wait(struct hwchar *h, int *slot, uint64_t *ns) {
+    struct hwchar_completion c;
+    int s, ret;
+
+    if (h->inflight == 0)
+        return -ENOENT;
+    if (ioctl(h->fd, HWCHAR_IOC_REAP, &c) < 0)
+        return -errno;
+
+    s = (int)c.cookie;
+    h->slot[s].busy = 0;
+    h->inflight--;
+    if (slot)
+        *slot = s;
+    if (ns)
+        *ns = c.ns;
+
+    if (c.status == 0 && h->slot[s].dir == HWCHAR_FROM_HW) {
+        ret = sync_range(h, s, HWCHAR_FROM_HW, h->slot[s].len, 1);
+        if (ret)
+            return ret;
+    }
+    return c.status;
+}
+
+int hwchar_drain(struct hwchar *h) {
+    int ret, before, first = 0;
+
+    while (h->inflight) {
+        before = h->inflight;
+        ret = hwchar_wait(h, NULL, NULL);
+        if (ret && !first)
+            first = ret;
+        if (h->inflight == before)
+            break;                  /* REAP itself failed (signal...) */
+    }
+    return first;
+}
+
+int hwchar_next_slot(struct hwchar *h) {
+    int slot = h->head, ret;
+
+    /* completions come in submission order: the oldest is this one */
+    while (h->slot[slot].busy) {
+        ret = hwchar_wait(h, NULL, NULL);
+        if (ret)
+            return ret;             /* call again for the slot */
+    }
+    h->head = (h->head + 1) % h->nslots;
+    return slot;
+}
+
+int hwchar_xfer(struct hwchar *h, int slot, int dir, size_t len) {
+    struct hwchar_range range;
+    int ret;
+
+    if (slot < 0 || slot >= h->nslots || len == 0 || len > h->slot_size)
+        return -EINVAL;
+
+    ret = sync_range(h, slot, dir, len, 0);
+    if (ret)
+        return ret;
+    range.offset = (size_t)slot * h->slot_size;
+    range.len = len;
+    if (ioctl(h->fd, dir == HWCHAR_TO_HW ? HWCHAR_IOC_DMA_TO_HW : HWCHAR_IOC_DMA_FROM_HW, &range) < 0)
+        return -errno;
+    if (dir == HWCHAR_FROM_HW)
+        return sync_range(h, slot, dir, len, 1);
+    return 0;
+}
@@ -0,0 +1,82 @@
+#ifndef _HWCHAR_CLIENT_H_
+#define _HWCHAR_CLIENT_H_
+
+/*
+ * User space client of /dev/hwchar: open and mmap once, then stream
+ *
+ * The mapped DMA buffer is cut in nslots slots of slot_size bytes, handed
+ * out as a ring. Slot i sits at offset i * slot_size of the buffer and DMAs
+ * to/from the same offset of the HW (a or b), like every hwchar job:
+ *
+ *   struct hwchar h;
+ *   hwchar_open(&h, NULL, 0, 65536);       (whole buffer, 64 KB slots)
+ *   for (;;) {
+ *       int slot = hwchar_next_slot(&h);   (reaps it if still in flight)
+ *       fill(hwchar_slot(&h, slot));
+ *       hwchar_submit(&h, slot, HWCHAR_TO_HW, 65536);
+ *   }
+ *   hwchar_drain(&h);
+ *   hwchar_close(&h);
+ *
+ * Nothing is copied: the program works in the slots, the driver DMAs them.
+ * The cache handover of a cached=1 buffer is done here (END_CPU_ACCESS at
+ * submit, BEGIN_CPU_ACCESS when a HWCHAR_FROM_HW slot is reaped).
+ *
+ * Calls return 0 (or a slot) on success and -errno on failure.
+ *
+ * Author  :   Sergio Rivera <srivera@alumnos.upm.es>
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mmap_CDMA_myHW.h"
+
+#define HWCHAR_BUF_SIZE_PARAM "/sys/module/mmap_CDMA_myHW/parameters/buf_size"
+
+struct hwchar {
+    int fd;
+    char *mem;                          /* the mapped DMA buffer */
+    size_t size;                        /* bytes mapped */
+    size_t slot_size;
+    int nslots;                         /* at most HWCHAR_QUEUE_DEPTH */
+    int head;                           /* next slot of the ring */
+    int inflight;                       /* submitted, not reaped yet */
+    struct {
+        int busy;
+        int dir;
+        size_t len;
+    } slot[HWCHAR_QUEUE_DEPTH];
+};
+
+/* dev NULL: HWCHAR_DEVICE_FILENAME. size 0: the whole buffer (buf_size of
+ * the module). slot_size 0: one slot of size bytes
+ */
+int hwchar_open(struct hwchar *h, const char *dev, size_t size, size_t slot_size);
+void hwchar_close(struct hwchar *h);
+
+static inline void *hwchar_slot(struct hwchar *h, int slot)
+{
+    return h->mem + (size_t)slot * h->slot_size;
+}
+
+/* the next slot of the ring, free to fill. A failed transfer reaped on
+ * the way is returned (-EIO...) instead, the next call goes on
+ */
+int hwchar_next_slot(struct hwchar *h);
+
+/* queue len bytes of slot one way, returns at once */
+int hwchar_submit(struct hwchar *h, int slot, int dir, size_t len);
+
+/* the oldest submitted slot, once its DMA is done: its status (and in slot,
+ * ns the time it took on the engine, if not NULL)
+ */
+int hwchar_wait(struct hwchar *h, int *slot, uint64_t *ns);
+
+/* wait for everything submitted, the first error if any */
+int hwchar_drain(struct hwchar *h);
+
+/* submit + wait outside the ring: len bytes of slot, returns when done */
+int hwchar_xfer(struct hwchar *h, int slot, int dir, size_t len);
+
+#endif /* _HWCHAR_CLIENT_H_ */
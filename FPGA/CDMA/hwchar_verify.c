@@ -0,0 +1,254 @@
+/* x86_64 + arm
+ *
+ * Vectorized, multithreaded compare of DMA results, see hwchar_verify.h
+ *
+ *  gcc -Wall -O2 -pthread -c hwchar_verify.c   (-mfpu=neon on 32 bits arm)
+ *
+ * Author  :   Sergio Rivera <srivera@alumnos.upm.es>
+ *
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HWVERIFY_NEON
+#endif
+
+#include "hwchar_verify.h"
+
+/* any difference in these HWVERIFY_BLOCK bytes? */
+static inline int block_differs(const uint8_t *a, const uint8_t *b) {
+#if defined(__SSE2__)
+    __m128i d0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)a),
+                               _mm_loadu_si128((const __m128i *)b));
+    __m128i d1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + 16)),
+                               _mm_loadu_si128((const __m128i *)(b + 16)));
+    __m128i d2 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + 32)),
+                               _mm_loadu_si128((const __m128i *)(b + 32)));
+    __m128i d3 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + 48)),
+                               _mm_loadu_si128((const __m128i *)(b + 48)));
+    __m128i d = _mm_or_si128(_mm_or_si128(d0, d1), _mm_or_si128(d2, d3));
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(d, _mm_setzero_si128())) != 0xffff;
+#elif defined(HWVERIFY_NEON)
+    uint8x16_t d = vorrq_u8(vorrq_u8(veorq_u8(vld1q_u8(a), vld1q_u8(b)),
+                                     veorq_u8(vld1q_u8(a + 16), vld1q_u8(b + 16))),
+                            vorrq_u8(veorq_u8(vld1q_u8(a + 32), vld1q_u8(b + 32)),
+                                     veorq_u8(vld1q_u8(a + 48), vld1q_u8(b + 48))));
+    uint64x2_t d64 = vreinterpretq_u64_u8(d);
+
+    return (vgetq_lane_u64(d64, 0) | vgetq_lane_u64(d64, 1)) != 0;
+#else
+    return memcmp(a, b, HWVERIFY_BLOCK) != 0;
+#endif
+}
+
+/* a block, or the tail of the buffer */
+static inline int span_differs(const uint8_t *a, const uint8_t *b, size_t n) {
+    return n == HWVERIFY_BLOCK ? block_differs(a, b) : memcmp(a, b, n) != 0;
+}
+
+struct chunk {
+    pthread_t tid;
+    const uint8_t *got;
+    const uint8_t *want;
+    size_t start, end;                  /* [start, end) of the buffers */
+    struct hwverify_result res;
+};
+
+static void add_range(struct hwverify_result *res, size_t start, size_t len, size_t bad) {
+    if (res->nranges < res->max) {
+        res->ranges[res->nranges].start = start;
+        res->ranges[res->nranges].len = len;
+    }
+    res->nranges++;
+    res->bad_bytes += bad;
+}
+
+/* ranges of [start, end): a range goes on while its blocks differ */
+static void *compare_chunk(void *arg) {
+    struct chunk *c = arg;
+    const uint8_t *a = c->got, *b = c->want;
+    size_t i = c->start, j, n, first, last, bad;
+
+    while (i < c->end) {
+        n = c->end - i < HWVERIFY_BLOCK ? c->end - i : HWVERIFY_BLOCK;
+        if (!span_differs(a + i, b + i, n)) {
+            i += n;
+            continue;
+        }
+        for (j = i; ; j += n) {
+            n = c->end - j < HWVERIFY_BLOCK ? c->end - j : HWVERIFY_BLOCK;
+            if (j >= c->end || !span_differs(a + j, b + j, n))
+                break;
+        }
+        /* exact first and last differing bytes, and how many differ */
+        for (first = i; a[first] == b[first]; first++)
+            ;
+        for (last = j - 1; a[last] == b[last]; last--)
+            ;
+        for (bad = 0, n = first; n <= last; n++)
+            bad += a[n] != b[n];
+        add_range(&c->res, first, last + 1 - first, bad);
+        i = j;
+    }
+    return NULL;
+}
+
+int hwverify_compare(const void *got, const void *want, size_t len, int nthreads,
+                     size_t max, struct hwverify_result *res) {
+    struct chunk *c;
+    struct hwverify_range *r, *prev;
+    size_t per, k, kept;
+    int t;
+
+    memset(res, 0, sizeof(*res));
+    if (nthreads < 1)
+        nthreads = 1;
+    c = calloc(nthreads, sizeof(*c));
+    res->ranges = calloc(max ? max : 1, sizeof(*res->ranges));
+    if (c == NULL || res->ranges == NULL) {
+        free(c);
+        free(res->ranges);
+        res->ranges = NULL;
+        return -ENOMEM;
+    }
+    res->max = max;
+    res->len = len;
+
+    /* block aligned pieces, one per thread */
+    per = (len / nthreads + HWVERIFY_BLOCK - 1) / HWVERIFY_BLOCK * HWVERIFY_BLOCK;
+    for (t = 0; t < nthreads; t++) {
+        c[t].got = got;
+        c[t].want = want;
+        c[t].start = per * t < len ? per * t : len;
+        c[t].end = per * (t + 1) < len ? per * (t + 1) : len;
+        c[t].res.max = max;
+        c[t].res.ranges = calloc(max ? max : 1, sizeof(*res->ranges));
+        if (c[t].res.ranges == NULL) {
+            while (t >= 0)
+                free(c[t--].res.ranges);
+            free(c);
+            hwverify_free(res);
+            return -ENOMEM;
+        }
+    }
+    for (t = 1; t < nthreads; t++) {
+        if (pthread_create(&c[t].tid, NULL, compare_chunk, &c[t])) {
+            compare_chunk(&c[t]);       /* in this thread then */
+            c[t].tid = 0;
+        }
+    }
+    compare_chunk(&c[0]);
+    for (t = 1; t < nthreads; t++)
+        if (c[t].tid)
+            pthread_join(c[t].tid, NULL);
+
+    /* in order, gluing ranges across the pieces */
+    for (t = 0; t < nthreads; t++) {
+        kept = c[t].res.nranges < max ? c[t].res.nranges : max;
+        res->bad_bytes += c[t].res.bad_bytes;
+        for (k = 0; k < c[t].res.nranges; k++) {
+            r = k < kept ? &c[t].res.ranges[k] : NULL;
+            prev = res->nranges && res->nranges <= max ? &res->ranges[res->nranges - 1] : NULL;
+            if (r && prev && k == 0 && prev->start + prev->len + HWVERIFY_BLOCK > r->start) {
+                prev->len = r->start + r->len - prev->start;
+                continue;
+            }
+            if (r && res->nranges < max)
+                res->ranges[res->nranges] = *r;
+            res->nranges++;
+        }
+        free(c[t].res.ranges);
+    }
+    free(c);
+    return res->nranges ? 1 : 0;
+}
+
+void hwverify_free(struct hwverify_result *res) {
+    free(res->ranges);
+    res->ranges = NULL;
+}
+
+/* the word at off as hex, only the bytes before len of a tail (little endian) */
+static const char *word_at(char *s, const void *p, size_t off, size_t len) {
+    size_t n = len - off < sizeof(uint32_t) ? len - off : sizeof(uint32_t);
+    uint32_t w = 0;
+
+    memcpy(&w, (const char *)p + off, n);
+    snprintf(s, 9, "%0*x", (int)(2 * n), (unsigned)w);
+    return s;
+}
+
+void hwverify_print(const char *what, const void *got, const void *want,
+                    const struct hwverify_result *res) {
+    char g[9], w[9];
+    size_t k, off;
+
+    printf("%s: %zu bytes differ in %zu range(s)\n", what, res->bad_bytes, res->nranges);
+    for (k = 0; k < res->nranges && k < res->max; k++) {
+        off = res->ranges[k].start & ~(size_t)3;
+        printf("  [0x%08zx, 0x%08zx) %8zu bytes  got %s want %s\n",
+               res->ranges[k].start, res->ranges[k].start + res->ranges[k].len,
+               res->ranges[k].len, word_at(g, got, off, res->len), word_at(w, want, off, res->len));
+    }
+    if (res->nranges > res->max)
+        printf("  ... %zu more\n", res->nranges - res->max);
+}
+
+void *hwverify_map_pl(unsigned long phys, size_t len) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    unsigned long base = phys & ~(page_size - 1);
+    size_t shift = phys - base;
+    char *p;
+    int fd;
+
+    fd = open("/dev/mem", O_RDWR | O_SYNC);
+    if (fd < 0)
+        return NULL;
+    p = mmap(NULL, len + shift, PROT_READ | PROT_WRITE, MAP_SHARED, fd, base);
+    close(fd);                          /* the mapping stays */
+    if (p == MAP_FAILED)
+        return NULL;
+    return p + shift;
+}
+
+void hwverify_unmap_pl(void *p, size_t len) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    size_t shift = (unsigned long)p & (page_size - 1);
+
+    munmap((char *)p - shift, len + shift);
+}
+
+void hwverify_copy_pl(void *dst, const void *pl, size_t len) {
+    const volatile uint32_t *src = pl;
+    uint32_t *d = dst;
+    size_t i;
+
+    for (i = 0; i < len / 4; i++)
+        d[i] = src[i];
+}
+
+void hwverify_pattern(void *buf, size_t len, uint64_t seed) {
+    uint64_t x = seed ? seed : 0x9e3779b97f4a7c15ull, *p = buf;
+    size_t i;
+
+    for (i = 0; i < len / 8; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        p[i] = x;
+    }
+    for (i = len & ~(size_t)7; i < len; i++)
+        ((uint8_t *)buf)[i] = (uint8_t)(x >> (8 * (i & 7)));
+}
@@ -0,0 +1,63 @@
+#ifndef _HWCHAR_VERIFY_H_
+#define _HWCHAR_VERIFY_H_
+
+/*
+ * Verification of DMA results: what came back against what was sent
+ *
+ * hwverify_compare() splits the buffers across threads, skips equal
+ * 64 bytes blocks with SSE2 (x86) or NEON (arm) and returns the mismatches
+ * as ranges: differences closer than a block are one range, so a broken
+ * transfer is a line, not a million of them. Multi-MB buffers take
+ * milliseconds.
+ *
+ * hwverify_map_pl() maps a PL window (a, b...) from /dev/mem once, to check
+ * the HW side itself without DMA.
+ *
+ * Author  :   Sergio Rivera <srivera@alumnos.upm.es>
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HWVERIFY_BLOCK  64
+
+struct hwverify_range {
+    size_t start;                       /* byte offset */
+    size_t len;
+};
+
+struct hwverify_result {
+    size_t len;                         /* bytes compared */
+    size_t bad_bytes;                   /* differing bytes, all ranges */
+    size_t nranges;                     /* all of them... */
+    struct hwverify_range *ranges;      /* ...the first max of them */
+    size_t max;
+};
+
+/* compare len bytes of got with want on nthreads threads; 0 when equal,
+ * 1 with res filled otherwise, -errno on failure. res->ranges is malloc'ed
+ * (hwverify_free())
+ */
+int hwverify_compare(const void *got, const void *want, size_t len, int nthreads,
+                     size_t max, struct hwverify_result *res);
+void hwverify_free(struct hwverify_result *res);
+
+/* one line per range (up to res->max) with the first word of each side,
+ * never reading past the res->len bytes compared
+ */
+void hwverify_print(const char *what, const void *got, const void *want,
+                    const struct hwverify_result *res);
+
+/* len bytes of physical memory at phys, NULL on failure (errno set) */
+void *hwverify_map_pl(unsigned long phys, size_t len);
+void hwverify_unmap_pl(void *p, size_t len);
+
+/* the mapping is device memory: snapshot it with aligned word reads (len a
+ * multiple of 4) and compare the copy
+ */
+void hwverify_copy_pl(void *dst, const void *pl, size_t len);
+
+/* xorshift pattern of seed, the same on every call */
+void hwverify_pattern(void *buf, size_t len, uint64_t seed);
+
+#endif /* _HWCHAR_VERIFY_H_ */
@@ -13,7 +13,104 @@
  *
  * 
  * compilation:
- *  $ make clean ; make ; sudo insmod mmap_myHW.ko
+ *  $ make clean ; make ; sudo insmod mmap_CDMA_myHW.ko
+ *
+ * The CDMA is a platform device, its registers and interrupt come from the
+ * device tree (0x7E200000 in the original project):
+ *
+ *    cdma@7e200000 {
+ *        compatible = "ldd3,hwchar-cdma";
+ *        reg = <0x7e200000 0x10000>;
+ *        interrupt-parent = <&intc>;
+ *        interrupts = <0 29 4>;
+ *    };
+ *
+ * Bitstreams with several CDMAs (one per HP port) list all of them in the
+ * same node, a reg and an interrupt per engine in the same order:
+ *
+ *        reg = <0x7e200000 0x10000>, <0x7e210000 0x10000>;
+ *        interrupts = <0 29 4>, <0 30 4>;
+ *
+ * read()/write()/ioctl transfers of stripe_min bytes or more are then split
+ * in 64 bytes aligned stripes, one per engine, started together and waited
+ * for all before the next chunk (scatter gather: one window per engine).
+ * stripe_min is compared with the whole transfer, not with the chunk_size
+ * pieces it goes through sh_mem in: each of those is striped on its own.
+ * Every engine must see RAM and a/b at the same addresses (no IOMMU).
+ *
+ * The DMA buffer (buf_size bytes) comes from CMA. For tens of MB give it a
+ * region of its own with a reserved-memory node and memory-region:
+ *
+ *    reserved-memory {
+ *        #address-cells = <1>;
+ *        #size-cells = <1>;
+ *        ranges;
+ *        hwchar_pool: hwchar@30000000 {
+ *            compatible = "shared-dma-pool";
+ *            reusable;
+ *            size = <0x4000000>;
+ *            alignment = <0x200000>;
+ *        };
+ *    };
+ *    ...
+ *        memory-region = <&hwchar_pool>;
+ *
+ * (or boot with cma=...). mmap() maps it with 4 KB PTEs. Only
+ * MAP_SHARED mappings are accepted, with the attributes dma_mmap_coherent()
+ * would use (cached=1: normal cacheable RAM).
+ *
+ * Transfers longer than spin_threshold bytes sleep until the IOC/error
+ * interrupt; shorter ones (or all of them without interrupt) poll the
+ * status register, which is faster for a few hundred bytes.
+ *
+ * read()/write() are not limited to the buffer: they are split in transfers
+ * of at most 2^btt_width - 1 bytes (the CDMA BTT register) and stream
+ * through the buf_size bytes of sh_mem, the HW side (a, b) is addressed
+ * linearly up to pl_size bytes.
+ *
+ * Through sh_mem, read()/write() go in chunk_size pieces: the copy from/to
+ * user space of one chunk runs while the CDMA moves the next/previous one,
+ * so large transfers take about max(copy, DMA) instead of copy + DMA.
+ *
+ * HWCHAR_IOC_SUBMIT/HWCHAR_IOC_REAP (see mmap_CDMA_myHW.h) queue transfers
+ * of the mmaped buffer and collect their completions later, poll() tells
+ * when one is ready: the engine runs the queue back to back.
+ * HWCHAR_IOC_DMA_TO_HW/HWCHAR_IOC_DMA_FROM_HW do the same synchronously:
+ * with the buffer already mmaped, no copy at all besides the DMA.
+ *
+ * cached=1 makes sh_mem cacheable RAM (streaming DMA) instead of the uncached
+ * coherent buffer: CPU fills and checks through mmap run at cache speed.
+ * read()/write() sync it themselves; users of the mapping hand every range
+ * over with HWCHAR_IOC_END_CPU_ACCESS before a DMA and take it back with
+ * HWCHAR_IOC_BEGIN_CPU_ACCESS after (no-ops on the coherent buffer).
+ *
+ * HWCHAR_IOC_EXPORT_DMABUF hands the DMA buffer out as a dma-buf fd, so
+ * a V4L2/DRM importer (or another process) uses the FPGA results in place.
+ * DMA_BUF_IOCTL_SYNC on that fd does the CPU_ACCESS handover. The dma_buf_ops
+ * are those of 4.14: newer kernels drop .map_atomic (4.19) and .map (5.6).
+ *
+ * /sys/kernel/debug/hwchar/calibrate sweeps transfer lengths and offsets
+ * and reports the size-versus-bandwidth curve, which replaces the hand
+ * measured figures below (see calib_show() for the format):
+ *  $ echo 64 4194304 32 > /sys/kernel/debug/hwchar/calibrate
+ *  $ cat /sys/kernel/debug/hwchar/calibrate
+ *
+ * /sys/class/mogu/hwchar/stats/ has live counters per direction: bytes,
+ * transfers, busy_ns, max_ns and MB/s over the last 1 and 10 seconds
+ * (echo 1 > reset clears them).
+ *
+ * dmaengine=1 doesn't touch the CDMA registers: the transfers go through any
+ * dmaengine memcpy channel (dma_channel=name picks one, dma_channels=n
+ * stripes on n of them), e.g. the Xilinx
+ * CDMA driver or soft_dma.ko on a box without FPGA (add emulate_pl=1 so a
+ * and b are a RAM buffer):
+ *  $ sudo insmod soft_dma.ko ; sudo insmod mmap_CDMA_myHW.ko dmaengine=1 emulate_pl=1
+ *
+ * If the CDMA is built with scatter gather, read()/write() of sg_threshold
+ * bytes or more pin the user pages and run a descriptor chain across them:
+ * no copy through sh_mem (and no 4 bytes shift in it, see the data path).
+ * Only word aligned buffers and lengths go that way (no DRE needed); pages
+ * that can't be pinned (another driver's mmap...) go through sh_mem.
  * 
  * 
  * MY HW just copy data from a to b (a and b are int arrays inside MY HW):
@@ -84,9 +181,31 @@
 #include <asm/uaccess.h>
 #include <asm/io.h>
 #include <linux/dma-mapping.h>
+#include <linux/moduleparam.h>
+#include <linux/platform_device.h>
+#include <linux/of.h>
+#include <linux/of_reserved_mem.h>
+#include <linux/interrupt.h>
+#include <linux/completion.h>
+#include <linux/scatterlist.h>
+#include <linux/pagemap.h>
+#include <linux/kfifo.h>
+#include <linux/workqueue.h>
+#include <linux/poll.h>
+#include <linux/sched/signal.h>
+#include <linux/dmaengine.h>
+#include <linux/math64.h>
+#include <linux/atomic.h>
+#include <linux/dma-buf.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include "xfer_hist.h"
+#include "mmap_CDMA_myHW.h"
 
 #define dataLength  (unsigned long)512000  // available bram byte
-#define MAX_SIZE dataLength   /* max size mmaped to userspace */
+#define MAX_SIZE dataLength   /* default size mmaped to userspace (buf_size) */
+#define BTT_WIDTH_DEFAULT   23  /* CDMA "Width of Buffer Length Register", bits */
 
 #define DEVICE_NAME "hwchar"
 #define  CLASS_NAME "mogu"
@@ -96,7 +215,8 @@
 #define b_BASE_ADDRESS          0xa0000000  // b address as seen from PS
 #define a_CDMA_ADDRESS          0xa0000000  // a address as seen from CDMA
 #define b_CDMA_ADDRESS          0xa0000000  // b address as seen from CDMA
-#define CDMA_BASE_ADDRESS       0x7E200000      
+#define CDMA_DRIVER_NAME        "hwchar-cdma"
+#define CDMA_TIMEOUT_MS         1000
 
 #define XAXICDMA_CR_OFFSET          0x00000000  /**< Control register */
 #define XAXICDMA_SR_OFFSET          0x00000004  /**< Status register */
@@ -122,6 +242,11 @@
 #define XAXICDMA_SR_ERR_SG_SLV_MASK     0x00000200  /**< SG slave err */
 #define XAXICDMA_SR_ERR_SG_DEC_MASK     0x00000400  /**< SG decode err */
 #define XAXICDMA_SR_ERR_ALL_MASK        0x00000770  /**< All errors */
+#define XAXICDMA_XR_COALESCE_MASK       0x00FF0000  /**< IOC threshold */
+#define XAXICDMA_COALESCE_SHIFT         16
+#define XAXICDMA_BD_STS_COMPLETE_MASK   0x80000000  /**< Completed */
+#define XAXICDMA_BD_STS_ALL_ERR_MASK    0x70000000  /**< All errors */
+#define XAXICDMA_BD_CTRL_LENGTH_MASK    0x007FFFFF  /**< Requested len */
 #define MAP_SIZE                    4096UL
 #define MAP_MASK                    (MAP_SIZE - 1)
 #define DDR_MAP_SIZE                0x10000000
@@ -144,259 +269,1859 @@ static struct class*  class;
 static struct device*  device;
 static int major;
 static char *sh_mem = NULL; 
-static unsigned long sh_mem_phys = 0;
+static dma_addr_t sh_mem_phys = 0;
+static phys_addr_t sh_mem_pa;   /* what mmap maps, bus == physical (no IOMMU) */
 
 static DEFINE_MUTEX(hwchar_mutex);
 
-static void print_nanos_len(int len, struct timespec diff) {
-    if (diff.tv_sec > 0)
-        printk ("HW_transfered(%d bytes), read time (ns): %lu\"%lu,", len, diff.tv_sec, diff.tv_nsec );
-    else
-        printk ("HW_transfered(%d bytes), read time (ns): %lu", len, diff.tv_nsec);
-}
+/* latency/size histograms in /sys/kernel/debug/hwchar/, see xfer_hist.h */
+static struct xfer_hist_set hwchar_hist;
 
-static void print_nanos(struct timespec diff) {
-    if (diff.tv_sec > 0)
-        printk ("read time (ns): %lu\"%lu,", diff.tv_sec, diff.tv_nsec );
-    else
-        printk ("read time (ns): %lu", diff.tv_nsec);
-}
-void __iomem *regs;
-/* CDMA
- * (this should be minimun to maximize speed)
- */ 
-static void cdma_write( int len, unsigned long SRC, unsigned long DST ) {
-    volatile unsigned long RegValue = 0;
-    iowrite32((unsigned long) SRC , ((volatile unsigned long *) (regs + XAXICDMA_SRCADDR_OFFSET)));
-    iowrite32((unsigned long) DST , ((volatile unsigned long *) (regs + XAXICDMA_DSTADDR_OFFSET)));
-    iowrite32((unsigned long) len , ((volatile unsigned long *) (regs + XAXICDMA_BTT_OFFSET    )));
-    do {
-        RegValue = (u32)ioread32(((volatile unsigned long *) (regs + XAXICDMA_SR_OFFSET)));
-    } while (!(RegValue & XAXICDMA_SR_IDLE_MASK));
- }
+/* live counters in /sys/class/mogu/hwchar/stats/, per direction (XFER_*) */
+#define RATE_SECS   10
 
-/*  executed once the device is closed or releaseed by userspace
- *  @param inodep: pointer to struct inode
- *  @param filep: pointer to struct file 
- */
-static int hwchar_release(struct inode *inodep, struct file *filep){    
-    mutex_unlock(&hwchar_mutex);
-    //pr_info("hwchar: Device successfully closed\n");
+struct hwchar_stats {
+    atomic64_t bytes;
+    atomic64_t xfers;
+    atomic64_t busy_ns;
+    atomic64_t max_ns;
+    spinlock_t lock;                    /* the per second ring */
+    u64 sec[RATE_SECS + 1];             /* second of every slot */
+    u64 sec_bytes[RATE_SECS + 1];
+};
 
-    return 0;
-}
+static struct hwchar_stats hwchar_stats[XFER_DIRS];
 
-/* executed once the device is opened.
- *
- */
-static int hwchar_open(struct inode *inodep, struct file *filep){
-    int ret = 0; 
+/* every completed transfer ends up here */
+static void hwchar_account(int dir, u64 ns, size_t bytes)
+{
+    struct hwchar_stats *st = &hwchar_stats[dir];
+    u64 now = ktime_get_seconds();
+    u32 slot;
+    u64 max;
 
-    if(!mutex_trylock(&hwchar_mutex)) {
-        pr_alert("hwchar: device busy!\n");
-        ret = -EBUSY;
-        goto out;
+    div_u64_rem(now, RATE_SECS + 1, &slot);
+
+    xfer_hist_add(&hwchar_hist, dir, ns, bytes);
+
+    atomic64_add(bytes, &st->bytes);
+    atomic64_inc(&st->xfers);
+    atomic64_add(ns, &st->busy_ns);
+    max = atomic64_read(&st->max_ns);
+    while (ns > max) {
+        u64 old = atomic64_cmpxchg(&st->max_ns, max, ns);
+        if (old == max)
+            break;
+        max = old;
     }
- 
-    pr_info("hwchar: Device opened\n");
-    printk("MAX_SIZE: %d \n", MAX_SIZE);
 
-out:
-    return ret;
+    spin_lock(&st->lock);
+    if (st->sec[slot] != now) {
+        st->sec[slot] = now;
+        st->sec_bytes[slot] = 0;
+    }
+    st->sec_bytes[slot] += bytes;
+    spin_unlock(&st->lock);
 }
 
-/*  mmap handler to map kernel space to user space  
- *
- */
-static int hwchar_mmap(struct file *filp, struct vm_area_struct *vma) {
-    int ret = 0;
-    struct page *page = NULL;
-    unsigned long size = (unsigned long)(vma->vm_end - vma->vm_start);
+/* bytes/s over the last secs complete seconds */
+static u64 hwchar_rate(int dir, int secs)
+{
+    struct hwchar_stats *st = &hwchar_stats[dir];
+    u64 now = ktime_get_seconds();
+    u64 sum = 0;
+    u32 slot;
+    int i;
 
-    if (size > MAX_SIZE) {
-        ret = -EINVAL;
-        goto out;  
-    } 
-   
-    page = virt_to_page((unsigned long)sh_mem + (vma->vm_pgoff << PAGE_SHIFT)); 
-    ret = remap_pfn_range(vma, vma->vm_start, page_to_pfn(page), size, vma->vm_page_prot);
-    if (ret != 0) {
-        goto out;
-    }   
+    spin_lock(&st->lock);
+    for (i = 1; i <= secs; i++) {
+        div_u64_rem(now - i, RATE_SECS + 1, &slot);
+        if (st->sec[slot] == now - i)
+            sum += st->sec_bytes[slot];
+    }
+    spin_unlock(&st->lock);
 
-out:
-    return ret;
+    return div_u64(sum, secs);
 }
 
-static ssize_t hwchar_read(struct file *filep, char *buffer, size_t len, loff_t *offset)
+static void hwchar_stats_reset(void)
 {
-    int ret;
-    struct timespec beginR, endR, diffR;
-    getnstimeofday (&beginR);
-
-   /* since RAM is writen from user space at address *sh_mem_phys to later be sent to the HW,
-      when we read from the HW we write RAM at *(sh_mem_phys + 4). This allow us to check
-      if we are actually using DMA in case that we read/write same thing to the HW: data will
-      be shifted 4 bytes in RAM after the transference */
-    cdma_write( (int) len, (unsigned long) b_CDMA_ADDRESS, (unsigned long) (sh_mem_phys + 4 ) );
+    int d;
 
-    getnstimeofday (&endR);
-    print_nanos_len(len, timespec_sub(endR, beginR));
+    for (d = 0; d < XFER_DIRS; d++) {
+        struct hwchar_stats *st = &hwchar_stats[d];
 
-    if (len > MAX_SIZE) {
-        printk(KERN_ALERT "read overflow!\n");
-        printk(KERN_ALERT "please, increase max size mmaped to userspace!\n");
-        ret = -EFAULT;
-        goto out;
+        atomic64_set(&st->bytes, 0);
+        atomic64_set(&st->xfers, 0);
+        atomic64_set(&st->busy_ns, 0);
+        atomic64_set(&st->max_ns, 0);
+        spin_lock(&st->lock);
+        memset(st->sec, 0, sizeof(st->sec));
+        memset(st->sec_bytes, 0, sizeof(st->sec_bytes));
+        spin_unlock(&st->lock);
     }
+}
 
-    if (raw_copy_to_user(buffer, sh_mem + 4 , len) == 0) {
-        ret = len;
+/* scatter gather descriptor, as read by the engine (64 bytes aligned) */
+struct cdma_desc {
+    u32 next;
+    u32 next_msb;
+    u32 src;
+    u32 src_msb;
+    u32 dst;
+    u32 dst_msb;
+    u32 control;                /* bytes to transfer */
+    u32 status;                 /* written back by the engine */
+} __aligned(64);
 
-    } else {
-        ret =  -EFAULT;   
-    } 
+/* one chain must fit the IOC threshold (8 bits) */
+#define SG_MAX_DESC     255
 
-out:
-    return ret;
-}
+/* the AXI CDMA engine */
+struct hwchar_cdma {
+    struct device *dev;
+    void __iomem *regs;
+    int irq;                    /* < 0: no interrupt, always poll */
+    struct completion done;     /* completed by the IOC/error interrupt */
+    bool sleeping;              /* the running transfer waits for the irq */
+    bool has_sg;                /* built with scatter gather */
+    struct cdma_desc *desc;     /* SG_MAX_DESC descriptors */
+    dma_addr_t desc_phys;
+    struct dma_chan *chan;      /* dmaengine mode: no regs, no irq */
+    dma_cookie_t cookie;        /* last transfer submitted */
+};
 
-static int reserve_buffer(void ) {
-    int id;
-    size_t size;
-    dma_addr_t paddr;
+/* all the engines (CDMAs or dmaengine channels) transfers are striped on */
+#define HWCHAR_MAX_ENGINES  8
 
-    sh_mem = (char *)dma_alloc_coherent(NULL, MAX_SIZE, &paddr, GFP_KERNEL); // FP_ATOMIC|GFP_DMA
-    sh_mem_phys = virt_to_phys(sh_mem);
+static struct hwchar_cdma engines[HWCHAR_MAX_ENGINES];
+static int nr_engines;
+static int engines_busy;        /* started by the last cdma_start() */
+static bool all_sg;             /* every engine does scatter gather */
+static struct device *dma_dev;  /* sh_mem and user pages are mapped for it */
 
-    if (sh_mem == NULL)
-    {
-        printk(KERN_ERR "ERROR: Allocation failure (sh_mem %p).\n", sh_mem);
-        return(-1);
-    }
-    return(0);
-}
+/* a and b as seen from the DMA, RAM of the DMA device when emulated */
+static dma_addr_t pl_a = a_CDMA_ADDRESS;
+static dma_addr_t pl_b = b_CDMA_ADDRESS;
+static void *pl_mem = NULL;
 
-static ssize_t hwchar_write(struct file *filep, const char *buffer, size_t len, loff_t *offset) {
-    int ret;
-    
-    if (raw_copy_from_user(sh_mem, buffer, len)) {
-        pr_err("hwchar: write fault!\n");
-        ret = -EFAULT;
-        goto out;
-    }
+static bool dmaengine = false;
+module_param(dmaengine, bool, S_IRUGO);
+MODULE_PARM_DESC(dmaengine, "use a dmaengine memcpy channel instead of programming the CDMA");
 
-    ret = len;
+static char *dma_channel = NULL;
+module_param(dma_channel, charp, S_IRUGO);
+MODULE_PARM_DESC(dma_channel, "dmaengine mode: name of the channel to use (default: any memcpy channel)");
 
-    struct timespec begin, end, diff;
-    getnstimeofday (&begin);
-    
-    cdma_write( (int) len, (unsigned long) sh_mem_phys, (unsigned long) a_CDMA_ADDRESS );
+static bool emulate_pl = false;
+module_param(emulate_pl, bool, S_IRUGO);
+MODULE_PARM_DESC(emulate_pl, "dmaengine mode: a and b are a RAM buffer instead of the PL (no FPGA needed)");
 
-    getnstimeofday (&end);
-    print_nanos_len(len, timespec_sub(end, begin));
+static unsigned long buf_size = MAX_SIZE;
+module_param(buf_size, ulong, S_IRUGO);
+MODULE_PARM_DESC(buf_size, "bytes of the DMA buffer mmaped to user space, larger read()/write() stream through it");
 
-out:
-    return ret;
-}
+static unsigned int btt_width = BTT_WIDTH_DEFAULT;
+module_param(btt_width, uint, S_IRUGO);
+MODULE_PARM_DESC(btt_width, "width in bits of the CDMA BTT register (8..26), longer transfers are split");
 
-static const struct file_operations hwchar_fops = {
-    .open = hwchar_open,
-    .read = hwchar_read,
-    .write = hwchar_write,
-    .release = hwchar_release,
-    .mmap = hwchar_mmap,
-    .owner = THIS_MODULE,
-};
+/* a and b of MY HW are MAX_SIZE bytes: without a bound, jobs and read()/
+ * write() would DMA to whatever the PL has past them
+ */
+static unsigned long pl_size = MAX_SIZE;
+module_param(pl_size, ulong, S_IRUGO);
+MODULE_PARM_DESC(pl_size, "bytes of a and b in the HW, DMA limit (default 512000, 0: no limit; at least buf_size if emulated)");
 
-static int __init hwchar_init(void) {
-    int ret = 0;    
-    
-    regs = ioremap_nocache(CDMA_BASE_ADDRESS,0x4);
+static bool cached = false;
+module_param(cached, bool, S_IRUGO);
+MODULE_PARM_DESC(cached, "cacheable streaming DMA buffer instead of a coherent (uncached) one, see HWCHAR_IOC_*_CPU_ACCESS");
+
+static unsigned int spin_threshold = 4096;
+module_param(spin_threshold, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(spin_threshold, "transfers up to this many bytes poll the CDMA instead of sleeping");
+
+static unsigned int sg_threshold = 65536;
+module_param(sg_threshold, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(sg_threshold, "transfers from this many bytes DMA straight to/from user pages (0: never)");
+
+static unsigned int dma_channels = 1;
+module_param(dma_channels, uint, S_IRUGO);
+MODULE_PARM_DESC(dma_channels, "dmaengine mode: number of memcpy channels to stripe on");
+
+static unsigned int stripe_min = 262144;
+module_param(stripe_min, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(stripe_min, "transfers from this many bytes are split across all the engines (0: never)");
+
+static unsigned int chunk_size = 65536;
+module_param(chunk_size, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(chunk_size, "bounce buffer transfers are pipelined in chunks of this many bytes (0: one shot)");
+
+/* one transfer at a time through the engine and sh_mem */
+static DEFINE_MUTEX(xfer_lock);
+
+/* asynchronous jobs (HWCHAR_IOC_SUBMIT): submission and completion queues,
+ * a work item runs the submitted jobs in order
+ */
+static DECLARE_KFIFO(job_sq, struct hwchar_job, HWCHAR_QUEUE_DEPTH);
+static DECLARE_KFIFO(job_cq, struct hwchar_completion, HWCHAR_QUEUE_DEPTH);
+static DEFINE_SPINLOCK(job_lock);           /* both fifos and job_pending */
+static unsigned int job_pending;            /* submitted and not reaped */
+static DECLARE_WAIT_QUEUE_HEAD(job_wait);
+static struct work_struct job_work;
+
+/* IOC or error: acknowledge it and wake the transfer up */
+static irqreturn_t cdma_irq(int irq, void *data)
+{
+    struct hwchar_cdma *c = data;
+    u32 sr = ioread32(c->regs + XAXICDMA_SR_OFFSET);
+
+    if (!(sr & XAXICDMA_XR_IRQ_ALL_MASK))
+        return IRQ_NONE;
+
+    iowrite32(sr & XAXICDMA_XR_IRQ_ALL_MASK, c->regs + XAXICDMA_SR_OFFSET);  // write 1 to clear
+    complete(&c->done);
+
+    return IRQ_HANDLED;
+}
+
+/* reset, enable interrupts and leave the engine in simple mode */
+static int cdma_reset(struct hwchar_cdma *c)
+{
     u32 RegValue = 0;
     int TimeOut = 1;
+    void __iomem *regs = c->regs;
 /* init CDMA configuration  */
     do {
         ResetMask = (unsigned long) XAXICDMA_CR_RESET_MASK;
         iowrite32((unsigned long) ResetMask     , ( (regs + XAXICDMA_CR_OFFSET    )));
         /* If the reset bit is still high, then reset is not done */
-        ResetMask = (u32)ioread32(((volatile unsigned long *) (regs + XAXICDMA_CR_OFFSET)));
+        ResetMask = (u32)ioread32(regs + XAXICDMA_CR_OFFSET);
         if (!(ResetMask & XAXICDMA_CR_RESET_MASK)) { break; }
            TimeOut -= 1;
     } while (TimeOut);
  //2) enable Interrupt
-    RegValue = (u32)ioread32(((volatile unsigned long *) (regs + XAXICDMA_CR_OFFSET)));
+    RegValue = (u32)ioread32(regs + XAXICDMA_CR_OFFSET);
     RegValue = (unsigned long) (RegValue | XAXICDMA_XR_IRQ_ALL_MASK);
-    iowrite32((unsigned long) RegValue          , ((volatile unsigned long *) (regs + XAXICDMA_CR_OFFSET    )));
+    iowrite32((unsigned long) RegValue          , regs + XAXICDMA_CR_OFFSET);
  //3) Checking for the Bus Idle
-    RegValue = (u32)ioread32(((volatile unsigned long *) (regs + XAXICDMA_SR_OFFSET)));
+    RegValue = (u32)ioread32(regs + XAXICDMA_SR_OFFSET);
     if (!(RegValue & XAXICDMA_SR_IDLE_MASK)) {
         printk("BUS IS BUSY Error Condition \n\r");
-        return 1;
+        return -EBUSY;
     }
  //4) Check the DMA Mode and switch it to simple mode
-    RegValue = (u32)ioread32(((volatile unsigned long *) (regs + XAXICDMA_CR_OFFSET)));
+    RegValue = (u32)ioread32(regs + XAXICDMA_CR_OFFSET);
     if ((RegValue & XAXICDMA_CR_SGMODE_MASK)) {
         RegValue = (unsigned long) (RegValue & (~XAXICDMA_CR_SGMODE_MASK));
-        iowrite32((unsigned long) RegValue      , ((volatile unsigned long *) (regs + XAXICDMA_CR_OFFSET)));
+        iowrite32((unsigned long) RegValue      , regs + XAXICDMA_CR_OFFSET);
     }
 /* end CDMA configuration   */
+    return 0;
+}
 
-    printk(KERN_INFO "trying to register the device /dev/hwchar \n");
+static void hwchar_dma_callback(void *param)
+{
+    struct hwchar_cdma *c = param;
 
-    major = register_chrdev(0, DEVICE_NAME, &hwchar_fops);
+    complete(&c->done);
+}
 
-    if (major < 0) {
-        pr_info("hwchar: fail to register major number!");
-        ret = major;
-        printk(KERN_ALERT "failed to register device /dev/hwchar \n");
-        goto out;
+/* queue one memcpy on the dmaengine channel, interrupt (callback) if last */
+static int chan_memcpy(struct hwchar_cdma *c, dma_addr_t dst, dma_addr_t src, size_t len, bool last)
+{
+    struct dma_async_tx_descriptor *tx;
+    dma_cookie_t cookie;
+
+    tx = dmaengine_prep_dma_memcpy(c->chan, dst, src, len,
+                                   last ? DMA_PREP_INTERRUPT | DMA_CTRL_ACK : DMA_CTRL_ACK);
+    if (tx == NULL)
+        return -ENOMEM;
+    if (last) {
+        tx->callback = hwchar_dma_callback;
+        tx->callback_param = c;
     }
+    cookie = dmaengine_submit(tx);
+    if (dma_submit_error(cookie))
+        return -EIO;
+    c->cookie = cookie;
+    return 0;
+}
 
-    class = class_create(THIS_MODULE, CLASS_NAME);
-    if (IS_ERR(class)){ 
-        unregister_chrdev(major, DEVICE_NAME);
-        pr_info("hwchar: failed to register device class");
-        ret = PTR_ERR(class);
-        goto out;
+/* CDMA
+ * (this should be minimun to maximize speed)
+ * Start a simple mode transfer on one engine, engine_wait() for it.
+ */ 
+static int engine_start( struct hwchar_cdma *c, int len, unsigned long SRC, unsigned long DST ) {
+    void __iomem *regs = c->regs;
+    int ret;
+
+    if (c->chan) {
+        c->sleeping = true;
+        reinit_completion(&c->done);
+        ret = chan_memcpy(c, DST, SRC, len, true);
+        if (ret)
+            return ret;
+        dma_async_issue_pending(c->chan);
+        return 0;
     }
 
-    device = device_create(class, NULL, MKDEV(major, 0), NULL, DEVICE_NAME);
-    if (IS_ERR(device)) {
-        class_destroy(class);
-        unregister_chrdev(major, DEVICE_NAME);
-        ret = PTR_ERR(device);
-        printk(KERN_ALERT "failed to register device /dev/hwchar \n");
-        goto out;
+    /* small transfers spin on SR, the rest sleep until the interrupt */
+    c->sleeping = c->irq >= 0 && len > spin_threshold;
+    if (c->sleeping)
+        reinit_completion(&c->done);
+
+    iowrite32((unsigned long) SRC , regs + XAXICDMA_SRCADDR_OFFSET);
+    iowrite32((unsigned long) DST , regs + XAXICDMA_DSTADDR_OFFSET);
+    iowrite32((unsigned long) len , regs + XAXICDMA_BTT_OFFSET    );
+    return 0;
+}
+
+/* dmaengine: the callback of the last descriptor, then its status */
+static int chan_wait(struct hwchar_cdma *c)
+{
+    if (!wait_for_completion_timeout(&c->done, msecs_to_jiffies(CDMA_TIMEOUT_MS))) {
+        dev_err(c->dev, "dmaengine transfer timed out\n");
+        dmaengine_terminate_sync(c->chan);
+        return -ETIMEDOUT;
+    }
+    if (dmaengine_tx_status(c->chan, c->cookie, NULL) != DMA_COMPLETE) {
+        dev_err(c->dev, "dmaengine transfer error\n");
+        return -EIO;
+    }
+    return 0;
+}
+
+/* until SR says idle (or error): the interrupt only wakes us up, it can
+ * be a late one of a previous polled transfer
+ */
+static int engine_wait(struct hwchar_cdma *c) {
+    void __iomem *regs = c->regs;
+    u32 RegValue = 0;
+    u64 deadline;
+
+    if (c->chan)
+        return chan_wait(c);
+
+    /* a hung engine must not spin forever with xfer_lock held */
+    deadline = ktime_get_ns() + (u64)CDMA_TIMEOUT_MS * NSEC_PER_MSEC;
+    for (;;) {
+        RegValue = (u32)ioread32(regs + XAXICDMA_SR_OFFSET);
+        if (RegValue & (XAXICDMA_SR_IDLE_MASK | XAXICDMA_SR_ERR_ALL_MASK))
+            break;
+        if (!c->sleeping) {
+            if (ktime_get_ns() > deadline)
+                goto timeout;
+            cpu_relax();
+            continue;
+        }
+        if (!wait_for_completion_timeout(&c->done, msecs_to_jiffies(CDMA_TIMEOUT_MS)))
+            goto timeout;
     }
 
-    printk(KERN_INFO "mapping memory to device /dev/hwchar \n");
+    if (RegValue & XAXICDMA_SR_ERR_ALL_MASK) {
+        dev_err(c->dev, "transfer error, SR 0x%08x\n", RegValue);
+        cdma_reset(c);
+        return -EIO;
+    }
+    return 0;
 
-    reserve_buffer(); // dma_alloc_coherent contiguous physical memory
+timeout:
+    dev_err(c->dev, "transfer timed out\n");
+    cdma_reset(c);
+    return -ETIMEDOUT;
+}
 
-    if (sh_mem == NULL) {
-        ret = -ENOMEM; 
-        printk("8\n");
-        goto out;
+/* how many engines a transfer of len bytes is striped on */
+static int stripes(size_t len)
+{
+    if (nr_engines == 1 || stripe_min == 0 || len < stripe_min)
+        return 1;
+    return nr_engines;
+}
+
+/* barrier: every stripe the last cdma_start() got going */
+static int cdma_wait(void) {
+    int i, err, ret = 0;
+
+    for (i = 0; i < engines_busy; i++) {
+        err = engine_wait(&engines[i]);
+        if (err && !ret)
+            ret = err;
     }
-    
-    mutex_init(&hwchar_mutex);
-out: 
+    engines_busy = 0;
     return ret;
 }
 
-static void __exit hwchar_exit(void) {
+/* start len bytes from SRC to DST, striped in 64 bytes aligned pieces
+ * across n engines (stripes() of the whole transfer this is a piece of);
+ * cdma_wait() is the barrier for all of them
+ */
+static int cdma_start( int n, int len, unsigned long SRC, unsigned long DST ) {
+    int piece = ALIGN(DIV_ROUND_UP(len, n), 64);
+    int off, ret = 0;
 
-    printk(KERN_INFO "trying to unregister the device /dev/hwchar \n");
+    engines_busy = 0;
+    for (off = 0; off < len && ret == 0; off += piece) {
+        int this = min(piece, len - off);
+
+        ret = engine_start(&engines[engines_busy], this, SRC + off, DST + off);
+        if (ret == 0)
+            engines_busy++;
+    }
+    if (ret)
+        cdma_wait();            /* the stripes already running */
+    return ret;
+}
+
+/* cached mode: ownership of a piece of sh_mem goes to the DMA... */
+static void buf_for_device(size_t off, size_t len, enum dma_data_direction dir)
+{
+    if (cached)
+        dma_sync_single_for_device(dma_dev, sh_mem_phys + off, len, dir);
+}
+
+/* ...and back to the CPU. Both are no-ops on the coherent buffer */
+static void buf_for_cpu(size_t off, size_t len, enum dma_data_direction dir)
+{
+    if (cached)
+        dma_sync_single_for_cpu(dma_dev, sh_mem_phys + off, len, dir);
+}
+
+/* largest transfer the BTT register takes, kept 64 bytes aligned */
+static size_t max_xfer(void)
+{
+    return ((1UL << btt_width) - 1) & ~63UL;
+}
+
+/* a transfer through sh_mem goes in chunks of this size. Up to buf_size
+ * bytes every chunk has its own place in sh_mem; longer ones use it as a
+ * ring of chunks, at most half of it each so that the chunk being copied
+ * never overlaps the one being moved by the CDMA
+ */
+static size_t pipeline_chunk(size_t len)
+{
+    size_t chunk = chunk_size ? chunk_size : len;
+
+    chunk = min(chunk, len);
+    chunk = min(chunk, max_xfer());
+    if (len > buf_size)
+        chunk = min_t(size_t, chunk, buf_size / 2);
+    return chunk;
+}
+
+/* bounce buffer write in chunks: user chunk n+1 is copied to sh_mem while
+ * the CDMA moves chunk n
+ */
+static int hwchar_write_pipelined(const char __user *buffer, size_t len, size_t pl_off)
+{
+    size_t chunk = pipeline_chunk(len);
+    size_t off, n, pos = 0;
+    int nr = stripes(len);
+    bool busy = false;
+    int ret = 0;
+
+    for (off = 0; off < len; off += n, pos += n) {
+        n = min(chunk, len - off);
+        if (pos + n > buf_size)
+            pos = 0;
+        if (raw_copy_from_user(sh_mem + pos, buffer + off, n)) {
+            ret = -EFAULT;
+            break;
+        }
+        buf_for_device(pos, n, DMA_TO_DEVICE);
+        if (busy) {
+            ret = cdma_wait();
+            if (ret)
+                return ret;
+        }
+        ret = cdma_start(nr, n, sh_mem_phys + pos, pl_a + pl_off + off);
+        if (ret)
+            return ret;
+        busy = true;
+    }
+    if (busy) {
+        int err = cdma_wait();
+        if (!ret)
+            ret = err;
+    }
+    return ret;
+}
+
+/* and the reverse: chunk n is copied to the user while chunk n+1 arrives */
+static int hwchar_read_pipelined(char __user *buffer, size_t len, size_t pl_off)
+{
+    size_t chunk = pipeline_chunk(len);
+    size_t off, n, pos = 0, prev_off = 0, prev_pos = 0, prev_n = 0;
+    int nr = stripes(len);
+    int ret;
+
+    if (len == 0)
+        return 0;
+
+    for (off = 0; off < len; off += n, pos += n) {
+        n = min(chunk, len - off);
+        if (pos + n > buf_size)
+            pos = 0;
+        if (prev_n) {
+            ret = cdma_wait();
+            if (ret)
+                return ret;
+        }
+        /* see hwchar_read() for the 4 bytes shift */
+        buf_for_device(4 + pos, n, DMA_FROM_DEVICE);
+        ret = cdma_start(nr, n, pl_b + pl_off + off, sh_mem_phys + 4 + pos);
+        if (ret)
+            return ret;
+        if (prev_n) {
+            buf_for_cpu(4 + prev_pos, prev_n, DMA_FROM_DEVICE);
+            if (raw_copy_to_user(buffer + prev_off, sh_mem + 4 + prev_pos, prev_n)) {
+                cdma_wait();
+                return -EFAULT;
+            }
+        }
+        prev_off = off;
+        prev_pos = pos;
+        prev_n = n;
+    }
+    ret = cdma_wait();
+    if (ret)
+        return ret;
+    buf_for_cpu(4 + prev_pos, prev_n, DMA_FROM_DEVICE);
+    if (raw_copy_to_user(buffer + prev_off, sh_mem + 4 + prev_pos, prev_n))
+        return -EFAULT;
+    return 0;
+}
+
+/* start a descriptor chain over the mapped scatterlist on one engine, the
+ * other end is the PL address pl (consecutive)
+ */
+static int engine_sg_start(struct hwchar_cdma *c, struct scatterlist *sgl, int nents,
+                           unsigned long pl, bool to_hw)
+{
+    void __iomem *regs = c->regs;
+    struct scatterlist *sg;
+    struct cdma_desc *d;
+    u32 cr;
+    int i, ret;
+
+    /* dmaengine: one memcpy per entry, issued together */
+    if (c->chan) {
+        c->sleeping = true;
+        reinit_completion(&c->done);
+        for_each_sg(sgl, sg, nents, i) {
+            if (to_hw)
+                ret = chan_memcpy(c, pl, sg_dma_address(sg), sg_dma_len(sg), i == nents - 1);
+            else
+                ret = chan_memcpy(c, sg_dma_address(sg), pl, sg_dma_len(sg), i == nents - 1);
+            if (ret) {
+                dmaengine_terminate_sync(c->chan);
+                return ret;
+            }
+            pl += sg_dma_len(sg);
+        }
+        dma_async_issue_pending(c->chan);
+        return 0;
+    }
+
+    for_each_sg(sgl, sg, nents, i) {
+        d = &c->desc[i];
+        d->next = c->desc_phys + (i + 1) * sizeof(*d);
+        d->next_msb = 0;
+        d->src = to_hw ? sg_dma_address(sg) : pl;
+        d->src_msb = 0;
+        d->dst = to_hw ? pl : sg_dma_address(sg);
+        d->dst_msb = 0;
+        d->control = sg_dma_len(sg) & XAXICDMA_BD_CTRL_LENGTH_MASK;
+        d->status = 0;
+        pl += sg_dma_len(sg);
+    }
+    wmb();
+
+    /* one interrupt for the whole chain */
+    cr = ioread32(regs + XAXICDMA_CR_OFFSET);
+    cr &= ~XAXICDMA_XR_COALESCE_MASK;
+    cr |= XAXICDMA_CR_SGMODE_MASK | (nents << XAXICDMA_COALESCE_SHIFT);
+    iowrite32(cr, regs + XAXICDMA_CR_OFFSET);
+    iowrite32(c->desc_phys, regs + XAXICDMA_CDESC_OFFSET);
+
+    c->sleeping = c->irq >= 0;
+    if (c->sleeping)
+        reinit_completion(&c->done);
+    iowrite32(c->desc_phys + (nents - 1) * sizeof(*d), regs + XAXICDMA_TDESC_OFFSET);
+    return 0;
+}
+
+/* wait for the chain, the engine is left in simple mode again */
+static int engine_sg_finish(struct hwchar_cdma *c, int nents)
+{
+    void __iomem *regs = c->regs;
+    u32 sts;
+    int ret;
+
+    ret = engine_wait(c);       /* resets the engine (to simple mode) on errors */
+    if (ret || c->chan)
+        return ret;
+    rmb();
+
+    sts = c->desc[nents - 1].status;
+    if (!(sts & XAXICDMA_BD_STS_COMPLETE_MASK) || (sts & XAXICDMA_BD_STS_ALL_ERR_MASK)) {
+        dev_err(c->dev, "SG transfer error, last status 0x%08x\n", sts);
+        cdma_reset(c);
+        return -EIO;
+    }
+
+    iowrite32(ioread32(regs + XAXICDMA_CR_OFFSET) & ~XAXICDMA_CR_SGMODE_MASK,
+              regs + XAXICDMA_CR_OFFSET);
+    return 0;
+}
+
+/* len bytes of the user buffer, pinned and mapped for one chain */
+struct sg_window {
+    struct page **pages;
+    int pinned;
+    struct sg_table sgt;
+    int nents;                  /* 0: not mapped */
+};
+
+static int sg_window_get(struct sg_window *w, unsigned long ubuf, size_t len, bool to_hw)
+{
+    enum dma_data_direction dir = to_hw ? DMA_TO_DEVICE : DMA_FROM_DEVICE;
+    unsigned int off = offset_in_page(ubuf);
+    int nr_pages = DIV_ROUND_UP(off + len, PAGE_SIZE);
+    int ret;
+
+    memset(w, 0, sizeof(*w));
+    w->pages = kmalloc_array(nr_pages, sizeof(*w->pages), GFP_KERNEL);
+    if (w->pages == NULL)
+        return -ENOMEM;
+
+    /* the engine writes into the pages on a read() */
+    w->pinned = get_user_pages_fast(ubuf & PAGE_MASK, nr_pages, !to_hw, w->pages);
+    if (w->pinned < nr_pages)
+        return w->pinned < 0 ? w->pinned : -EFAULT;
+
+    ret = sg_alloc_table_from_pages(&w->sgt, w->pages, nr_pages, off, len, GFP_KERNEL);
+    if (ret)
+        return ret;
+
+    w->nents = dma_map_sg(dma_dev, w->sgt.sgl, w->sgt.orig_nents, dir);
+    if (w->nents == 0) {
+        sg_free_table(&w->sgt);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+/* undo sg_window_get(), however far it went */
+static void sg_window_put(struct sg_window *w, bool to_hw, bool ok)
+{
+    enum dma_data_direction dir = to_hw ? DMA_TO_DEVICE : DMA_FROM_DEVICE;
+    int i;
+
+    if (w->nents) {
+        dma_unmap_sg(dma_dev, w->sgt.sgl, w->sgt.orig_nents, dir);
+        sg_free_table(&w->sgt);
+    }
+    for (i = 0; i < w->pinned; i++) {
+        if (!to_hw && ok)
+            set_page_dirty_lock(w->pages[i]);
+        put_page(w->pages[i]);
+    }
+    kfree(w->pages);
+}
 
+/* no bounce copy: to_hw user -> a, otherwise b -> user. One chain per
+ * window of at most SG_MAX_DESC - 1 pages (no entry can then exceed the
+ * BTT either), a window per engine at a time when striping.
+ * Stops at the first window whose pages can't be pinned or mapped: *done
+ * bytes were moved, the caller sends the rest through sh_mem
+ */
+static int hwchar_sg_xfer(unsigned long ubuf, size_t len, bool to_hw, size_t *done)
+{
+    struct sg_window w[HWCHAR_MAX_ENGINES];
+    size_t window = min_t(size_t, (SG_MAX_DESC - 1) * PAGE_SIZE, max_xfer());
+    unsigned long pl = to_hw ? pl_a : pl_b;
+    int n = stripes(len);
+    size_t off = 0, wlen;
+    bool bounce = false;
+    int i, used, err, ret = 0;
+
+    if (n > 1)
+        window = min_t(size_t, window, PAGE_ALIGN(DIV_ROUND_UP(len, n)));
+
+    while (off < len && ret == 0 && !bounce) {
+        /* pin and start up to n windows, one per engine */
+        for (used = 0; used < n && off < len; used++) {
+            wlen = min(len - off, window - offset_in_page(ubuf + off));
+            if (sg_window_get(&w[used], ubuf + off, wlen, to_hw)) {
+                sg_window_put(&w[used], to_hw, false);
+                bounce = true;
+                break;
+            }
+            ret = engine_sg_start(&engines[used], w[used].sgt.sgl, w[used].nents,
+                                  pl + off, to_hw);
+            if (ret) {
+                sg_window_put(&w[used], to_hw, false);
+                break;
+            }
+            off += wlen;
+        }
+        /* barrier: every started chain ends before the pages go */
+        for (i = 0; i < used; i++) {
+            err = engine_sg_finish(&engines[i], w[i].nents);
+            if (err && !ret)
+                ret = err;
+        }
+        for (i = 0; i < used; i++)
+            sg_window_put(&w[i], to_hw, ret == 0);
+    }
+    *done = off;
+    return ret;
+}
+
+/* a CDMA without DRE takes word aligned addresses and lengths only */
+#define SG_ALIGN    4
+
+static bool use_sg(const void __user *ubuf, size_t len)
+{
+    if (((unsigned long)ubuf | len) & (SG_ALIGN - 1))
+        return false;
+    return all_sg && sg_threshold && len >= sg_threshold;
+}
+
+/* a range of sh_mem */
+static bool buf_range_ok(u64 offset, u64 len)
+{
+    return len != 0 && offset < buf_size && len <= buf_size - offset;
+}
+
+/* jobs DMA offset..offset + len of the buffer to the same bytes of a/b,
+ * so the range has to fit in both (pl_mem has pl_size bytes when emulated)
+ */
+static bool range_ok(u64 offset, u64 len)
+{
+    if (!buf_range_ok(offset, len))
+        return false;
+    return !pl_size || (offset < pl_size && len <= pl_size - offset);
+}
+
+/* DMA between offset of sh_mem and the same offset of the HW, no copy to
+ * or from user space: the caller fills/checks the mmaped buffer (and, on a
+ * cached buffer, hands it over with the CPU_ACCESS ioctls)
+ */
+static int hwchar_kick(int dir, size_t offset, size_t len, u64 *ns)
+{
+    size_t done, n;
+    int nr = stripes(len);
+    u64 t0;
+    int ret = 0;
+
+    mutex_lock(&xfer_lock);
+    t0 = ktime_get_ns();
+    for (done = 0; done < len && ret == 0; done += n) {
+        n = min(len - done, max_xfer());
+        if (dir == HWCHAR_TO_HW)
+            ret = cdma_start(nr, n, sh_mem_phys + offset + done, pl_a + offset + done);
+        else
+            ret = cdma_start(nr, n, pl_b + offset + done, sh_mem_phys + offset + done);
+        if (ret == 0)
+            ret = cdma_wait();
+    }
+    *ns = ktime_get_ns() - t0;
+    mutex_unlock(&xfer_lock);
+
+    if (ret == 0)
+        hwchar_account(dir == HWCHAR_TO_HW ? XFER_WRITE : XFER_READ, *ns, len);
+    return ret;
+}
+
+/* run the submitted jobs back to back, in order */
+static void hwchar_job_work(struct work_struct *work)
+{
+    struct hwchar_job job;
+    struct hwchar_completion c;
+
+    while (kfifo_out_spinlocked(&job_sq, &job, 1, &job_lock)) {
+        c.status = hwchar_kick(job.dir, job.offset, job.len, &c.ns);
+        c.cookie = job.cookie;
+        c.pad = 0;
+        /* always room: job_pending counts the job until it is reaped */
+        kfifo_in_spinlocked(&job_cq, &c, 1, &job_lock);
+        wake_up_interruptible(&job_wait);
+    }
+}
+
+static bool job_can_submit(void)
+{
+    bool ret;
+
+    spin_lock(&job_lock);
+    ret = job_pending < HWCHAR_QUEUE_DEPTH;
+    spin_unlock(&job_lock);
+    return ret;
+}
+
+static int hwchar_submit(struct file *filep, struct hwchar_job *job)
+{
+    int ret;
+
+    if (job->dir > HWCHAR_FROM_HW || !range_ok(job->offset, job->len))
+        return -EINVAL;
+
+    for (;;) {
+        spin_lock(&job_lock);
+        if (job_pending < HWCHAR_QUEUE_DEPTH) {
+            job_pending++;
+            kfifo_put(&job_sq, *job);
+            spin_unlock(&job_lock);
+            break;
+        }
+        spin_unlock(&job_lock);
+
+        if (filep->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        ret = wait_event_interruptible(job_wait, job_can_submit());
+        if (ret)
+            return ret;
+    }
+
+    queue_work(system_unbound_wq, &job_work);
+    return 0;
+}
+
+static int hwchar_reap(struct file *filep, struct hwchar_completion *c)
+{
+    int ret;
+
+    for (;;) {
+        spin_lock(&job_lock);
+        if (kfifo_get(&job_cq, c)) {
+            job_pending--;
+            spin_unlock(&job_lock);
+            wake_up_interruptible(&job_wait);   /* room to submit */
+            return 0;
+        }
+        /* nothing submitted: no completion will ever come */
+        if (job_pending == 0) {
+            spin_unlock(&job_lock);
+            return -ENODATA;
+        }
+        spin_unlock(&job_lock);
+
+        if (filep->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        ret = wait_event_interruptible(job_wait, !kfifo_is_empty(&job_cq) ||
+                                                 READ_ONCE(job_pending) == 0);
+        if (ret)
+            return ret;
+    }
+}
+
+/* the attributes dma_mmap_coherent() gives the coherent buffer on this
+ * arch (4.x): write-combine/bufferable for a non coherent device on ARM and
+ * arm64, nothing for a coherent one, uncached from dma_common_mmap() on
+ * x86. false where we don't know them
+ */
+static bool hwchar_coherent_pgprot(pgprot_t *prot)
+{
+#if defined(CONFIG_ARM64)
+    if (!is_device_dma_coherent(dma_dev))
+        *prot = pgprot_writecombine(*prot);
+    return true;
+#elif defined(CONFIG_ARM)
+    if (!is_device_dma_coherent(dma_dev))
+        *prot = pgprot_dmacoherent(*prot);
+    return true;
+#elif defined(CONFIG_X86)
+    *prot = pgprot_noncached(*prot);
+    return true;
+#else
+    return false;
+#endif
+}
+
+/* sh_mem into a user mapping, for /dev/hwchar and its dma-bufs */
+static int hwchar_mmap_buf(struct vm_area_struct *vma)
+{
+    if (vma->vm_pgoff + vma_pages(vma) > PAGE_ALIGN(buf_size + 4) >> PAGE_SHIFT)
+        return -EINVAL;
+
+    /* pfn mappings can't be copied on write: MAP_SHARED only */
+    if (!(vma->vm_flags & VM_SHARED))
+        return -EINVAL;
+
+    /* cached: plain cacheable RAM, the ioctls keep it in sync with the DMA.
+     * Otherwise what the DMA API would map it with, or the DMA API itself
+     * on the other archs
+     */
+    if (!cached && !hwchar_coherent_pgprot(&vma->vm_page_prot))
+        return dma_mmap_coherent(dma_dev, vma, sh_mem, sh_mem_phys, buf_size + 4);
+
+    /* 4 KB PTEs only: a huge PMD of these pages would be torn down as an
+     * anonymous THP on munmap (rmap and refcount of the CMA pages)
+     */
+    return remap_pfn_range(vma, vma->vm_start, PHYS_PFN(sh_mem_pa) + vma->vm_pgoff,
+                           vma->vm_end - vma->vm_start, vma->vm_page_prot);
+}
+
+/* dma-buf exporter: sh_mem for any importer (V4L2, DRM...), one
+ * contiguous chunk mapped for the importing device on every attachment
+ */
+static struct sg_table *hwchar_map_dma_buf(struct dma_buf_attachment *attach,
+                                           enum dma_data_direction dir)
+{
+    struct sg_table *sgt;
+    int ret;
+
+    sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+    if (sgt == NULL)
+        return ERR_PTR(-ENOMEM);
+
+    if (cached) {
+        ret = sg_alloc_table(sgt, 1, GFP_KERNEL);
+        if (ret == 0)
+            sg_set_page(sgt->sgl, virt_to_page(sh_mem), PAGE_ALIGN(buf_size + 4), 0);
+    } else {
+        ret = dma_get_sgtable(dma_dev, sgt, sh_mem, sh_mem_phys, buf_size + 4);
+    }
+    if (ret)
+        goto out_free;
+
+    if (dma_map_sg(attach->dev, sgt->sgl, sgt->orig_nents, dir) == 0) {
+        ret = -ENOMEM;
+        goto out_table;
+    }
+    return sgt;
+
+out_table:
+    sg_free_table(sgt);
+out_free:
+    kfree(sgt);
+    return ERR_PTR(ret);
+}
+
+static void hwchar_unmap_dma_buf(struct dma_buf_attachment *attach,
+                                 struct sg_table *sgt, enum dma_data_direction dir)
+{
+    dma_unmap_sg(attach->dev, sgt->sgl, sgt->orig_nents, dir);
+    sg_free_table(sgt);
+    kfree(sgt);
+}
+
+/* DMA_BUF_IOCTL_SYNC and in-kernel CPU users: same as the CPU_ACCESS ioctls */
+static int hwchar_dmabuf_begin_cpu_access(struct dma_buf *dmabuf, enum dma_data_direction dir)
+{
+    buf_for_cpu(0, buf_size, dir);
+    return 0;
+}
+
+static int hwchar_dmabuf_end_cpu_access(struct dma_buf *dmabuf, enum dma_data_direction dir)
+{
+    buf_for_device(0, buf_size, dir);
+    return 0;
+}
+
+static void *hwchar_dmabuf_kmap(struct dma_buf *dmabuf, unsigned long page)
+{
+    return sh_mem + page * PAGE_SIZE;
+}
+
+static void *hwchar_dmabuf_vmap(struct dma_buf *dmabuf)
+{
+    return sh_mem;
+}
+
+static int hwchar_dmabuf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
+{
+    return hwchar_mmap_buf(vma);
+}
+
+/* nothing to free: sh_mem lives until the module goes, and every dma-buf
+ * holds a reference on the module
+ */
+static void hwchar_dmabuf_release(struct dma_buf *dmabuf)
+{
+}
+
+static const struct dma_buf_ops hwchar_dmabuf_ops = {
+    .map_dma_buf = hwchar_map_dma_buf,
+    .unmap_dma_buf = hwchar_unmap_dma_buf,
+    .release = hwchar_dmabuf_release,
+    .begin_cpu_access = hwchar_dmabuf_begin_cpu_access,
+    .end_cpu_access = hwchar_dmabuf_end_cpu_access,
+    .map = hwchar_dmabuf_kmap,
+    .map_atomic = hwchar_dmabuf_kmap,
+    .vmap = hwchar_dmabuf_vmap,
+    .mmap = hwchar_dmabuf_mmap,
+};
+
+/* a new dma-buf of the whole buffer, returns its fd */
+static int hwchar_export_dmabuf(u32 flags)
+{
+    DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+    struct dma_buf *dmabuf;
+    int fd;
+
+    exp_info.ops = &hwchar_dmabuf_ops;
+    exp_info.size = PAGE_ALIGN(buf_size + 4);
+    exp_info.flags = flags & O_ACCMODE;
+    dmabuf = dma_buf_export(&exp_info);
+    if (IS_ERR(dmabuf))
+        return PTR_ERR(dmabuf);
+
+    fd = dma_buf_fd(dmabuf, flags & O_CLOEXEC);
+    if (fd < 0)
+        dma_buf_put(dmabuf);
+    return fd;
+}
+
+static long hwchar_ioctl(struct file *filep, unsigned int cmd, unsigned long arg)
+{
+    struct hwchar_job job;
+    struct hwchar_completion c;
+    struct hwchar_range range;
+    struct hwchar_sync sync;
+    struct hwchar_dmabuf exp;
+    enum dma_data_direction dir;
+    u64 ns;
+    int ret;
+
+    if (_IOC_TYPE(cmd) != HWCHAR_IOC_MAGIC || _IOC_NR(cmd) > HWCHAR_IOC_MAXNR)
+        return -ENOTTY;
+
+    switch (cmd) {
+    case HWCHAR_IOC_SUBMIT:
+        if (copy_from_user(&job, (void __user *)arg, sizeof(job)))
+            return -EFAULT;
+        return hwchar_submit(filep, &job);
+
+    case HWCHAR_IOC_REAP:
+        ret = hwchar_reap(filep, &c);
+        if (ret)
+            return ret;
+        if (copy_to_user((void __user *)arg, &c, sizeof(c)))
+            return -EFAULT;         /* the completion is lost */
+        return 0;
+
+    case HWCHAR_IOC_DMA_TO_HW:
+    case HWCHAR_IOC_DMA_FROM_HW:
+        if (copy_from_user(&range, (void __user *)arg, sizeof(range)))
+            return -EFAULT;
+        if (!range_ok(range.offset, range.len))
+            return -EINVAL;
+        return hwchar_kick(cmd == HWCHAR_IOC_DMA_TO_HW ? HWCHAR_TO_HW : HWCHAR_FROM_HW,
+                           range.offset, range.len, &ns);
+
+    case HWCHAR_IOC_BEGIN_CPU_ACCESS:
+    case HWCHAR_IOC_END_CPU_ACCESS:
+        if (copy_from_user(&sync, (void __user *)arg, sizeof(sync)))
+            return -EFAULT;
+        if (sync.dir > HWCHAR_FROM_HW || !buf_range_ok(sync.offset, sync.len))
+            return -EINVAL;
+        dir = sync.dir == HWCHAR_TO_HW ? DMA_TO_DEVICE : DMA_FROM_DEVICE;
+        if (cmd == HWCHAR_IOC_BEGIN_CPU_ACCESS)
+            buf_for_cpu(sync.offset, sync.len, dir);
+        else
+            buf_for_device(sync.offset, sync.len, dir);
+        return 0;
+
+    case HWCHAR_IOC_EXPORT_DMABUF:
+        if (copy_from_user(&exp, (void __user *)arg, sizeof(exp)))
+            return -EFAULT;
+        if (exp.flags & ~(O_CLOEXEC | O_ACCMODE))
+            return -EINVAL;
+        ret = hwchar_export_dmabuf(exp.flags);
+        if (ret < 0)
+            return ret;
+        exp.fd = ret;
+        if (copy_to_user((void __user *)arg, &exp, sizeof(exp)))
+            return -EFAULT;         /* the fd stays open */
+        return 0;
+
+    default:
+        return -ENOTTY;
+    }
+}
+
+static unsigned int hwchar_poll(struct file *filep, poll_table *wait)
+{
+    unsigned int mask = 0;
+
+    poll_wait(filep, &job_wait, wait);
+
+    spin_lock(&job_lock);
+    if (!kfifo_is_empty(&job_cq))
+        mask |= POLLIN | POLLRDNORM;
+    if (job_pending < HWCHAR_QUEUE_DEPTH)
+        mask |= POLLOUT | POLLWRNORM;
+    spin_unlock(&job_lock);
+
+    return mask;
+}
+
+/*  executed once the device is closed or releaseed by userspace
+ *  @param inodep: pointer to struct inode
+ *  @param filep: pointer to struct file 
+ */
+static int hwchar_release(struct inode *inodep, struct file *filep){    
+    /* let the queued jobs finish, forget the completions nobody reaped */
+    flush_work(&job_work);
+    spin_lock(&job_lock);
+    kfifo_reset(&job_cq);
+    job_pending = 0;
+    spin_unlock(&job_lock);
+
+    mutex_unlock(&hwchar_mutex);
+    //pr_info("hwchar: Device successfully closed\n");
+
+    return 0;
+}
+
+/* executed once the device is opened.
+ *
+ */
+static int hwchar_open(struct inode *inodep, struct file *filep){
+    int ret = 0; 
+
+    if(!mutex_trylock(&hwchar_mutex)) {
+        pr_alert("hwchar: device busy!\n");
+        ret = -EBUSY;
+        goto out;
+    }
+ 
+    pr_info("hwchar: Device opened\n");
+    printk("buf_size: %lu \n", buf_size);
+
+out:
+    return ret;
+}
+
+/*  mmap handler to map kernel space to user space  
+ *
+ */
+static int hwchar_mmap(struct file *filp, struct vm_area_struct *vma) {
+    unsigned long size = (unsigned long)(vma->vm_end - vma->vm_start);
+
+    if (size > PAGE_ALIGN(buf_size + 4))
+        return -EINVAL;
+
+    return hwchar_mmap_buf(vma);
+}
+
+static ssize_t hwchar_read(struct file *filep, char *buffer, size_t len, loff_t *offset)
+{
+    size_t done = 0;
+    int ret;
+    u64 t0;
+
+    if (pl_size && len > pl_size) {
+        pr_err_ratelimited("hwchar: read overflow, please, increase pl_size!\n");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    mutex_lock(&xfer_lock);
+    t0 = ktime_get_ns();
+
+    if (use_sg(buffer, len)) {
+        ret = hwchar_sg_xfer((unsigned long)buffer, len, false, &done);
+        if (ret)
+            goto out_unlock;
+    }
+
+   /* since RAM is writen from user space at address *sh_mem_phys to later be sent to the HW,
+      when we read from the HW we write RAM at *(sh_mem_phys + 4). This allow us to check
+      if we are actually using DMA in case that we read/write same thing to the HW: data will
+      be shifted 4 bytes in RAM after the transference */
+    ret = hwchar_read_pipelined(buffer + done, len - done, done);
+    if (ret)
+        goto out_unlock;
+
+    hwchar_account(XFER_READ, ktime_get_ns() - t0, len);
+    ret = len;
+
+out_unlock:
+    mutex_unlock(&xfer_lock);
+out:
+    return ret;
+}
+
+/* dma_alloc_coherent contiguous physical memory, 4 extra bytes for the
+ * shifted read (see hwchar_read). Cached: contiguous pages mapped for
+ * streaming DMA, the syncs hand them between the CPU and the DMA
+ */
+static int reserve_buffer(struct device *dev) {
+    if (cached) {
+        sh_mem = alloc_pages_exact(buf_size + 4, GFP_KERNEL | __GFP_ZERO);
+        if (sh_mem == NULL) {
+            printk(KERN_ERR "ERROR: Allocation failure (cached sh_mem, %lu bytes, "
+                   "larger buffers need the coherent one from CMA).\n", buf_size + 4);
+            return -ENOMEM;
+        }
+        sh_mem_phys = dma_map_single(dev, sh_mem, buf_size + 4, DMA_BIDIRECTIONAL);
+        if (dma_mapping_error(dev, sh_mem_phys)) {
+            free_pages_exact(sh_mem, buf_size + 4);
+            sh_mem = NULL;
+            return -ENOMEM;
+        }
+        sh_mem_pa = virt_to_phys(sh_mem);
+        return 0;
+    }
+
+    /* from the device's memory-region if it has one, else the default CMA */
+    sh_mem = (char *)dma_alloc_coherent(dev, buf_size + 4, &sh_mem_phys, GFP_KERNEL); // FP_ATOMIC|GFP_DMA
+
+    if (sh_mem == NULL)
+    {
+        printk(KERN_ERR "ERROR: Allocation failure (sh_mem %p).\n", sh_mem);
+        return -ENOMEM;
+    }
+    sh_mem_pa = sh_mem_phys;
+    return(0);
+}
+
+static void release_buffer(struct device *dev) {
+    if (cached) {
+        dma_unmap_single(dev, sh_mem_phys, buf_size + 4, DMA_BIDIRECTIONAL);
+        free_pages_exact(sh_mem, buf_size + 4);
+    } else {
+        dma_free_coherent(dev, buf_size + 4, sh_mem, sh_mem_phys);
+    }
+    sh_mem = NULL;
+}
+
+static ssize_t hwchar_write(struct file *filep, const char *buffer, size_t len, loff_t *offset) {
+    size_t done = 0;
+    int ret;
+    u64 t0;
+
+    if (pl_size && len > pl_size) {
+        pr_err_ratelimited("hwchar: write overflow, please, increase pl_size!\n");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    mutex_lock(&xfer_lock);
+
+    /* the copies from user space overlap the DMA, time them too */
+    t0 = ktime_get_ns();
+
+    if (use_sg(buffer, len)) {
+        ret = hwchar_sg_xfer((unsigned long)buffer, len, true, &done);
+        if (ret)
+            goto out_unlock;
+    }
+
+    /* whatever scatter gather didn't take (all of it, usually) */
+    ret = hwchar_write_pipelined(buffer + done, len - done, done);
+    if (ret) {
+        if (ret == -EFAULT)
+            pr_err("hwchar: write fault!\n");
+        goto out_unlock;
+    }
+
+    hwchar_account(XFER_WRITE, ktime_get_ns() - t0, len);
+    ret = len;
+
+out_unlock:
+    mutex_unlock(&xfer_lock);
+out:
+    return ret;
+}
+
+static const struct file_operations hwchar_fops = {
+    .open = hwchar_open,
+    .read = hwchar_read,
+    .write = hwchar_write,
+    .release = hwchar_release,
+    .mmap = hwchar_mmap,
+    .unlocked_ioctl = hwchar_ioctl,
+    .poll = hwchar_poll,
+    .owner = THIS_MODULE,
+};
+
+/* sysfs: stats/{read,write}_{bytes,transfers,busy_ns,max_ns,mbps_1s,mbps_10s}
+ * and stats/reset
+ */
+enum { ST_BYTES, ST_XFERS, ST_BUSY_NS, ST_MAX_NS, ST_MBPS_1S, ST_MBPS_10S };
+
+static ssize_t stats_show(int dir, int what, char *buf)
+{
+    struct hwchar_stats *st = &hwchar_stats[dir];
+    u64 rate, mb;
+    u32 rem;
+
+    switch (what) {
+    case ST_BYTES:
+        return sprintf(buf, "%llu\n", (u64)atomic64_read(&st->bytes));
+    case ST_XFERS:
+        return sprintf(buf, "%llu\n", (u64)atomic64_read(&st->xfers));
+    case ST_BUSY_NS:
+        return sprintf(buf, "%llu\n", (u64)atomic64_read(&st->busy_ns));
+    case ST_MAX_NS:
+        return sprintf(buf, "%llu\n", (u64)atomic64_read(&st->max_ns));
+    default:
+        rate = hwchar_rate(dir, what == ST_MBPS_1S ? 1 : RATE_SECS);
+        /* MB/s with 3 decimals */
+        mb = div_u64_rem(rate, 1000000, &rem);
+        return sprintf(buf, "%llu.%03u\n", mb, rem / 1000);
+    }
+}
+
+#define HWCHAR_STAT_ATTR(_dir, _d, _name, _what)                               \
+static ssize_t _dir##_##_name##_show(struct device *dev,                       \
+                                     struct device_attribute *attr, char *buf) \
+{                                                                              \
+    return stats_show(_d, _what, buf);                                         \
+}                                                                              \
+static DEVICE_ATTR_RO(_dir##_##_name)
+
+HWCHAR_STAT_ATTR(read, XFER_READ, bytes, ST_BYTES);
+HWCHAR_STAT_ATTR(read, XFER_READ, transfers, ST_XFERS);
+HWCHAR_STAT_ATTR(read, XFER_READ, busy_ns, ST_BUSY_NS);
+HWCHAR_STAT_ATTR(read, XFER_READ, max_ns, ST_MAX_NS);
+HWCHAR_STAT_ATTR(read, XFER_READ, mbps_1s, ST_MBPS_1S);
+HWCHAR_STAT_ATTR(read, XFER_READ, mbps_10s, ST_MBPS_10S);
+HWCHAR_STAT_ATTR(write, XFER_WRITE, bytes, ST_BYTES);
+HWCHAR_STAT_ATTR(write, XFER_WRITE, transfers, ST_XFERS);
+HWCHAR_STAT_ATTR(write, XFER_WRITE, busy_ns, ST_BUSY_NS);
+HWCHAR_STAT_ATTR(write, XFER_WRITE, max_ns, ST_MAX_NS);
+HWCHAR_STAT_ATTR(write, XFER_WRITE, mbps_1s, ST_MBPS_1S);
+HWCHAR_STAT_ATTR(write, XFER_WRITE, mbps_10s, ST_MBPS_10S);
+
+static ssize_t reset_store(struct device *dev, struct device_attribute *attr,
+                           const char *buf, size_t count)
+{
+    hwchar_stats_reset();
+    return count;
+}
+static DEVICE_ATTR_WO(reset);
+
+static struct attribute *hwchar_stats_attrs[] = {
+    &dev_attr_read_bytes.attr,
+    &dev_attr_read_transfers.attr,
+    &dev_attr_read_busy_ns.attr,
+    &dev_attr_read_max_ns.attr,
+    &dev_attr_read_mbps_1s.attr,
+    &dev_attr_read_mbps_10s.attr,
+    &dev_attr_write_bytes.attr,
+    &dev_attr_write_transfers.attr,
+    &dev_attr_write_busy_ns.attr,
+    &dev_attr_write_max_ns.attr,
+    &dev_attr_write_mbps_1s.attr,
+    &dev_attr_write_mbps_10s.attr,
+    &dev_attr_reset.attr,
+    NULL,
+};
+
+static const struct attribute_group hwchar_stats_group = {
+    .name = "stats",
+    .attrs = hwchar_stats_attrs,
+};
+
+static const struct attribute_group *hwchar_groups[] = {
+    &hwchar_stats_group,
+    NULL,
+};
+
+/* debugfs: hwchar/calibrate, the size-versus-bandwidth curve of the
+ * current bitstream and clocks
+ *
+ *   echo [min [max [reps]]] > calibrate
+ *     DMAs reps times every length from min to max bytes (doubling) at every
+ *     offset of calib_offsets, both ways, timed with ktime. It needs
+ *     /dev/hwchar closed and overwrites the buffer and a/b
+ *   cat calibrate
+ *     one CSV line per point, then per direction the peak and the smallest
+ *     transfer reaching CALIB_PCT % of it: a good chunk_size
+ */
+#define CALIB_MAX_POINTS    512
+#define CALIB_PCT           95
+
+/* word aligned: a CDMA without DRE rejects anything else (status -EIO) */
+static const unsigned int calib_offsets[] = { 0, 4, 8, 16, 32, 64 };
+
+struct calib_point {
+    u8 dir;                     /* XFER_READ or XFER_WRITE */
+    u32 bytes;
+    u32 offset;
+    u32 reps;
+    int status;
+    u64 best_ns;
+    u64 avg_ns;
+};
+
+static struct calib_point calib[CALIB_MAX_POINTS];
+static int calib_points;
+static DEFINE_MUTEX(calib_lock);
+
+static u64 calib_mbps_milli(u64 bytes, u64 ns)
+{
+    return ns ? div64_u64(bytes * 1000000, ns) : 0;
+}
+
+static int calib_point_run(struct calib_point *p)
+{
+    u64 t0, ns, total = 0;
+    int i, ret = 0;
+
+    p->best_ns = U64_MAX;
+    for (i = 0; i < p->reps && ret == 0; i++) {
+        t0 = ktime_get_ns();
+        if (p->dir == XFER_WRITE)
+            ret = cdma_start(stripes(p->bytes), p->bytes, sh_mem_phys + p->offset, pl_a + p->offset);
+        else
+            ret = cdma_start(stripes(p->bytes), p->bytes, pl_b + p->offset, sh_mem_phys + p->offset);
+        if (ret == 0)
+            ret = cdma_wait();
+        ns = ktime_get_ns() - t0;
+        total += ns;
+        p->best_ns = min(p->best_ns, ns);
+    }
+    p->avg_ns = div_u64(total, i);
+    return ret;
+}
+
+static int hwchar_calibrate(unsigned int min, unsigned int max, unsigned int reps)
+{
+    size_t limit = min(buf_size, max_xfer());
+    struct calib_point *p;
+    unsigned int len, o;
+    int dir, n = 0;
+
+    if (min == 0 || reps == 0 || max < min)
+        return -EINVAL;
+    if (pl_size)
+        limit = min_t(size_t, limit, pl_size);
+
+    /* nobody else uses the buffer or the engines meanwhile */
+    if (!mutex_trylock(&hwchar_mutex))
+        return -EBUSY;
+    if (sh_mem == NULL) {
+        mutex_unlock(&hwchar_mutex);
+        return -ENODEV;
+    }
+    mutex_lock(&calib_lock);
+    mutex_lock(&xfer_lock);
+
+    for (dir = XFER_READ; dir < XFER_DIRS; dir++) {
+        for (len = min; len <= max && len <= limit; len *= 2) {
+            for (o = 0; o < ARRAY_SIZE(calib_offsets); o++) {
+                if (len + calib_offsets[o] > limit || n == CALIB_MAX_POINTS)
+                    break;
+                p = &calib[n++];
+                p->dir = dir;
+                p->bytes = len;
+                p->offset = calib_offsets[o];
+                p->reps = reps;
+                p->status = calib_point_run(p);
+                cond_resched();
+            }
+            if (len > UINT_MAX / 2)
+                break;
+        }
+    }
+    calib_points = n;
+
+    mutex_unlock(&xfer_lock);
+    mutex_unlock(&calib_lock);
+    mutex_unlock(&hwchar_mutex);
+    pr_info("hwchar: calibrated %d points\n", n);
+    return 0;
+}
+
+static int calib_show(struct seq_file *m, void *v)
+{
+    static const char * const dir_name[XFER_DIRS] = { "read", "write" };
+    struct calib_point *p;
+    u64 best, avg, peak;
+    u32 rem, peak_bytes, chunk;
+    int dir, i;
+
+    mutex_lock(&calib_lock);
+    seq_puts(m, "dir,bytes,offset,reps,best_ns,avg_ns,best_MBps,avg_MBps,status\n");
+    for (i = 0; i < calib_points; i++) {
+        p = &calib[i];
+        best = calib_mbps_milli(p->bytes, p->best_ns);
+        avg = calib_mbps_milli(p->bytes, p->avg_ns);
+        seq_printf(m, "%s,%u,%u,%u,%llu,%llu,", dir_name[p->dir], p->bytes, p->offset,
+                   p->reps, p->best_ns, p->avg_ns);
+        best = div_u64_rem(best, 1000, &rem);
+        seq_printf(m, "%llu.%03u,", best, rem);
+        avg = div_u64_rem(avg, 1000, &rem);
+        seq_printf(m, "%llu.%03u,%d\n", avg, rem, p->status);
+    }
+
+    /* on the aligned points only, average bandwidth */
+    for (dir = XFER_READ; dir < XFER_DIRS; dir++) {
+        peak = 0;
+        peak_bytes = chunk = 0;
+        for (i = 0; i < calib_points; i++) {
+            p = &calib[i];
+            if (p->dir != dir || p->offset || p->status)
+                continue;
+            avg = calib_mbps_milli(p->bytes, p->avg_ns);
+            if (avg > peak) {
+                peak = avg;
+                peak_bytes = p->bytes;
+            }
+        }
+        for (i = 0; i < calib_points && peak; i++) {
+            p = &calib[i];
+            if (p->dir != dir || p->offset || p->status)
+                continue;
+            if (calib_mbps_milli(p->bytes, p->avg_ns) * 100 >= peak * CALIB_PCT) {
+                chunk = p->bytes;
+                break;
+            }
+        }
+        if (peak == 0)
+            continue;
+        avg = div_u64_rem(peak, 1000, &rem);
+        seq_printf(m, "# %s: peak %llu.%03u MB/s at %u bytes, %d%% from %u bytes\n",
+                   dir_name[dir], avg, rem, peak_bytes, CALIB_PCT, chunk);
+    }
+    mutex_unlock(&calib_lock);
+    return 0;
+}
+
+static int calib_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, calib_show, NULL);
+}
+
+static ssize_t calib_write(struct file *file, const char __user *ubuf,
+                           size_t len, loff_t *ppos)
+{
+    unsigned int min = 64, max = buf_size, reps = 16;
+    char buf[48];
+    int ret;
+
+    if (len >= sizeof(buf))
+        return -EINVAL;
+    if (raw_copy_from_user(buf, ubuf, len))
+        return -EFAULT;
+    buf[len] = '\0';
+    sscanf(buf, "%u %u %u", &min, &max, &reps);
+
+    ret = hwchar_calibrate(min, max, reps);
+    return ret ? ret : len;
+}
+
+static const struct file_operations calib_fops = {
+    .owner = THIS_MODULE,
+    .open = calib_open,
+    .read = seq_read,
+    .write = calib_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+/* the DMA buffer (from the device that does the DMA) and /dev/hwchar */
+static int hwchar_setup(struct device *dev)
+{
+    int ret;
+
+    printk(KERN_INFO "mapping memory to device /dev/hwchar \n");
+    ret = reserve_buffer(dev);
+    if (ret)
+        return ret;
+
+    device = device_create_with_groups(class, dev, MKDEV(major, 0), NULL, hwchar_groups, DEVICE_NAME);
+    if (IS_ERR(device)) {
+        ret = PTR_ERR(device);
+        printk(KERN_ALERT "failed to register device /dev/hwchar \n");
+        release_buffer(dev);
+        return ret;
+    }
+    return 0;
+}
+
+static void hwchar_teardown(struct device *dev)
+{
+    device_destroy(class, MKDEV(major, 0));
+    release_buffer(dev);
+}
+
+/* one CDMA per reg/interrupts pair of the node (same order), all of them
+ * on the same bus view of the memory as the first one
+ */
+static int hwchar_probe_engine(struct platform_device *pdev, struct resource *res, int i)
+{
+    struct hwchar_cdma *c = &engines[i];
+    int ret;
+
+    c->regs = devm_ioremap_resource(&pdev->dev, res);
+    if (IS_ERR(c->regs)) {
+        ret = PTR_ERR(c->regs);
+        c->regs = NULL;
+        return ret;
+    }
+    c->dev = &pdev->dev;
+    init_completion(&c->done);
+
+    ret = cdma_reset(c);
+    if (ret)
+        return ret;
+
+    c->has_sg = ioread32(c->regs + XAXICDMA_SR_OFFSET) & XAXICDMA_SR_SGINCLD_MASK;
+    if (c->has_sg) {
+        c->desc = dmam_alloc_coherent(&pdev->dev, SG_MAX_DESC * sizeof(*c->desc),
+                                      &c->desc_phys, GFP_KERNEL);
+        if (c->desc == NULL)
+            return -ENOMEM;
+    }
+
+    c->irq = platform_get_irq(pdev, i);
+    if (c->irq >= 0) {
+        ret = devm_request_irq(&pdev->dev, c->irq, cdma_irq, 0, DEVICE_NAME, c);
+        if (ret)
+            return ret;
+    } else {
+        dev_warn(&pdev->dev, "CDMA %d: no interrupt, polling the status register\n", i);
+    }
+    return 0;
+}
+
+/* /dev/hwchar exists while the CDMAs are bound to the driver */
+static int hwchar_probe(struct platform_device *pdev)
+{
+    struct resource *res;
+    int i, ret;
+
+    if (nr_engines) {
+        dev_err(&pdev->dev, "only one hwchar-cdma node is supported\n");
+        return -EBUSY;
+    }
+
+    all_sg = true;
+    for (i = 0; i < HWCHAR_MAX_ENGINES; i++) {
+        res = platform_get_resource(pdev, IORESOURCE_MEM, i);
+        if (res == NULL)
+            break;
+        ret = hwchar_probe_engine(pdev, res, i);
+        if (ret)
+            goto fail;
+        all_sg &= engines[i].has_sg;
+    }
+    if (i == 0) {
+        dev_err(&pdev->dev, "no CDMA registers\n");
+        return -ENODEV;
+    }
+    nr_engines = i;
+    dma_dev = &pdev->dev;
+
+    /* memory-region = <&a shared-dma-pool>: the buffer comes from that
+     * dedicated (CMA if reusable) region
+     */
+    ret = of_reserved_mem_device_init(dma_dev);
+    if (ret == 0)
+        dev_info(&pdev->dev, "buffer from the reserved memory-region\n");
+    else if (ret != -ENODEV)
+        goto fail;
+
+    dev_info(&pdev->dev, "%d CDMA(s), striping from %u bytes\n", nr_engines, stripe_min);
+    if (all_sg)
+        dev_info(&pdev->dev, "scatter gather from %u bytes\n", sg_threshold);
+
+    ret = hwchar_setup(dma_dev);
+    if (ret)
+        goto fail_mem;
+    return 0;
+
+fail_mem:
+    of_reserved_mem_device_release(dma_dev);
+fail:
+    nr_engines = 0;
+    memset(engines, 0, sizeof(engines));
+    return ret;
+}
+
+static int hwchar_remove(struct platform_device *pdev)
+{
+    hwchar_teardown(&pdev->dev);
+    of_reserved_mem_device_release(&pdev->dev);
+    /* devm unmaps them and frees the interrupts */
+    nr_engines = 0;
+    memset(engines, 0, sizeof(engines));
+    return 0;
+}
+
+static const struct of_device_id hwchar_of_match[] = {
+    { .compatible = "ldd3,hwchar-cdma", },
+    {}
+};
+MODULE_DEVICE_TABLE(of, hwchar_of_match);
+
+static struct platform_driver hwchar_driver = {
+    .probe = hwchar_probe,
+    .remove = hwchar_remove,
+    .driver = {
+        .name = CDMA_DRIVER_NAME,
+        .owner = THIS_MODULE,
+        .of_match_table = hwchar_of_match,
+        .suppress_bind_attrs = true,    /* exported dma-bufs use sh_mem */
+    },
+};
+
+static bool hwchar_chan_filter(struct dma_chan *chan, void *param)
+{
+    return dma_channel == NULL || strcmp(dma_chan_name(chan), dma_channel) == 0;
+}
+
+static void hwchar_chan_release(void)
+{
+    while (nr_engines > 0) {
+        nr_engines--;
+        dma_release_channel(engines[nr_engines].chan);
+        engines[nr_engines].chan = NULL;
+    }
+}
+
+/* dmaengine mode: dma_channels memcpy capable channels (Xilinx CDMA
+ * driver, soft_dma.ko...) instead of the CDMA registers; the buffer is
+ * mapped for the first one
+ */
+static int hwchar_chan_init(void)
+{
+    struct hwchar_cdma *c;
+    dma_cap_mask_t mask;
+    int ret;
+
+    dma_cap_zero(mask);
+    dma_cap_set(DMA_MEMCPY, mask);
+    while (nr_engines < dma_channels) {
+        c = &engines[nr_engines];
+        c->chan = dma_request_channel(mask, hwchar_chan_filter, NULL);
+        if (c->chan == NULL)
+            break;
+        c->dev = c->chan->device->dev;
+        init_completion(&c->done);
+        c->irq = -ENXIO;
+        dev_info(c->dev, "hwchar: using dmaengine channel %s\n", dma_chan_name(c->chan));
+        nr_engines++;
+    }
+    if (nr_engines == 0) {
+        printk(KERN_ERR "hwchar: no dmaengine memcpy channel %s\n", dma_channel ? dma_channel : "");
+        return -ENODEV;
+    }
+    if (nr_engines < dma_channels)
+        printk(KERN_WARNING "hwchar: only %d of %u dmaengine channels\n", nr_engines, dma_channels);
+    dma_dev = engines[0].dev;
+    all_sg = true;              /* user pages go as a batch of memcpys */
+
+    if (emulate_pl) {
+        pl_size = max_t(unsigned long, pl_size, buf_size);    /* all the buffer can DMA */
+        pl_mem = dma_alloc_coherent(dma_dev, pl_size, &pl_a, GFP_KERNEL);
+        if (pl_mem == NULL) {
+            ret = -ENOMEM;
+            goto out_chan;
+        }
+        pl_b = pl_a;            /* MY HW: a and b are the same memory */
+    }
+
+    ret = hwchar_setup(dma_dev);
+    if (ret)
+        goto out_pl;
+    return 0;
+
+out_pl:
+    if (pl_mem)
+        dma_free_coherent(dma_dev, pl_size, pl_mem, pl_a);
+out_chan:
+    hwchar_chan_release();
+    return ret;
+}
+
+static void hwchar_chan_exit(void)
+{
+    hwchar_teardown(dma_dev);
+    if (pl_mem)
+        dma_free_coherent(dma_dev, pl_size, pl_mem, pl_a);
+    hwchar_chan_release();
+}
+
+static int __init hwchar_init(void) {
+    int ret = 0;    
+
+    if (btt_width < 8 || btt_width > 26 || buf_size < PAGE_SIZE) {
+        printk(KERN_ERR "hwchar: btt_width must be 8..26 and buf_size at least a page\n");
+        return -EINVAL;
+    }
+    if (dma_channels < 1 || dma_channels > HWCHAR_MAX_ENGINES) {
+        printk(KERN_ERR "hwchar: dma_channels must be 1..%d\n", HWCHAR_MAX_ENGINES);
+        return -EINVAL;
+    }
+
+    printk(KERN_INFO "trying to register the device /dev/hwchar \n");
+
+    major = register_chrdev(0, DEVICE_NAME, &hwchar_fops);
+
+    if (major < 0) {
+        pr_info("hwchar: fail to register major number!");
+        ret = major;
+        printk(KERN_ALERT "failed to register device /dev/hwchar \n");
+        goto out;
+    }
+
+    class = class_create(THIS_MODULE, CLASS_NAME);
+    if (IS_ERR(class)){ 
+        unregister_chrdev(major, DEVICE_NAME);
+        pr_info("hwchar: failed to register device class");
+        ret = PTR_ERR(class);
+        goto out;
+    }
+
+    mutex_init(&hwchar_mutex);
+    INIT_KFIFO(job_sq);
+    INIT_KFIFO(job_cq);
+    INIT_WORK(&job_work, hwchar_job_work);
+
+    spin_lock_init(&hwchar_stats[XFER_READ].lock);
+    spin_lock_init(&hwchar_stats[XFER_WRITE].lock);
+
+    ret = xfer_hist_init(&hwchar_hist, DEVICE_NAME);
+    if (ret)
+        goto out_class;
+    if (hwchar_hist.dir)
+        debugfs_create_file("calibrate", 0600, hwchar_hist.dir, NULL, &calib_fops);
+
+    if (dmaengine) {
+        ret = hwchar_chan_init();
+        if (ret)
+            goto out_hist;
+        return 0;
+    }
+
+    /* /dev/hwchar shows up when the CDMA is probed */
+    ret = platform_driver_register(&hwchar_driver);
+    if (ret) {
+        printk(KERN_ERR "hwchar: platform_driver_register() %s\n", CDMA_DRIVER_NAME);
+        goto out_hist;
+    }
+    return 0;
+
+out_hist:
+    xfer_hist_exit(&hwchar_hist);
+out_class:
+    class_destroy(class);
+    unregister_chrdev(major, DEVICE_NAME);
+out: 
+    return ret;
+}
+
+static void __exit hwchar_exit(void) {
+
+    printk(KERN_INFO "trying to unregister the device /dev/hwchar \n");
+
+    if (dmaengine)
+        hwchar_chan_exit();
+    else
+        platform_driver_unregister(&hwchar_driver);
+    xfer_hist_exit(&hwchar_hist);
     mutex_destroy(&hwchar_mutex); 
-    device_destroy(class, MKDEV(major, 0));  
-    class_unregister(class);
     class_destroy(class); 
     unregister_chrdev(major, DEVICE_NAME);
-    iounmap(CDMA_BASE_ADDRESS);
-    
-    sh_mem=NULL; // ->  NULL pointer dereference 
 
     pr_info("hwchar: unregistered!");
 }
@@ -0,0 +1,109 @@
+#ifndef _MMAP_CDMA_MYHW_H_
+#define _MMAP_CDMA_MYHW_H_
+
+/*
+ * Definitions shared by mmap_CDMA_myHW.c and the user space programs
+ *
+ * Author  :   Sergio Rivera <srivera@alumnos.upm.es>
+ */
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define HWCHAR_DEVICE_FILENAME "/dev/hwchar"
+
+/*
+ * Asynchronous jobs
+ *
+ * A job moves len bytes between offset of the mmaped DMA buffer and the
+ * same offset of the HW (a for HWCHAR_TO_HW, b for HWCHAR_FROM_HW), no copy
+ * to/from user space. HWCHAR_IOC_SUBMIT queues one job and returns at once
+ * (it blocks while HWCHAR_QUEUE_DEPTH jobs are queued or not reaped, or
+ * fails with EAGAIN on O_NONBLOCK). Jobs run in submission order.
+ *
+ * HWCHAR_IOC_REAP returns the oldest completion, blocking until there is
+ * one (EAGAIN on O_NONBLOCK), or fails with ENODATA when no job is pending. poll() reports POLLIN when a completion is
+ * ready and POLLOUT when a job can be submitted.
+ */
+#define HWCHAR_TO_HW        0
+#define HWCHAR_FROM_HW      1
+
+#define HWCHAR_QUEUE_DEPTH  64
+
+struct hwchar_job {
+    __u32 dir;                  /* HWCHAR_TO_HW or HWCHAR_FROM_HW */
+    __u32 pad;
+    __u64 offset;               /* in the mmaped buffer and in the HW */
+    __u64 len;
+    __u64 cookie;               /* returned as is in the completion */
+};
+
+struct hwchar_completion {
+    __u64 cookie;
+    __s32 status;               /* 0 or -errno */
+    __u32 pad;
+    __u64 ns;                   /* time on the engine */
+};
+
+/*
+ * Synchronous transfers of the mmaped buffer
+ *
+ * HWCHAR_IOC_DMA_TO_HW / HWCHAR_IOC_DMA_FROM_HW move len bytes between
+ * offset of the mmaped buffer and the same offset of the HW and return when
+ * the DMA is done. Unlike write()/read() nothing is copied from/to user
+ * space: fill the mapping, kick, check the mapping. They don't wait for
+ * queued jobs.
+ */
+struct hwchar_range {
+    __u64 offset;
+    __u64 len;
+};
+
+/*
+ * Cache maintenance of the mmaped buffer (module loaded with cached=1,
+ * no-ops otherwise)
+ *
+ * The buffer is then normal cacheable memory and the CPU and the DMA own a
+ * range in turns, dir telling which way the data goes:
+ *
+ *   to the HW:    fill ... HWCHAR_IOC_END_CPU_ACCESS(HWCHAR_TO_HW)
+ *                 HWCHAR_IOC_DMA_TO_HW
+ *   from the HW:  HWCHAR_IOC_END_CPU_ACCESS(HWCHAR_FROM_HW)
+ *                 HWCHAR_IOC_DMA_FROM_HW
+ *                 HWCHAR_IOC_BEGIN_CPU_ACCESS(HWCHAR_FROM_HW) ... check
+ */
+struct hwchar_sync {
+    __u64 offset;
+    __u64 len;
+    __u32 dir;                  /* HWCHAR_TO_HW or HWCHAR_FROM_HW */
+    __u32 pad;
+};
+
+/*
+ * dma-buf export
+ *
+ * HWCHAR_IOC_EXPORT_DMABUF returns in fd a new dma-buf of the whole DMA
+ * buffer (what mmap gives), for any dma-buf importer: V4L2 (V4L2_MEMORY_DMABUF),
+ * DRM (PRIME), another process over a unix socket... flags takes O_CLOEXEC
+ * and O_RDONLY/O_RDWR (needed to mmap the fd writable). CPU access through
+ * the fd is bracketed with DMA_BUF_IOCTL_SYNC, which does what the
+ * CPU_ACCESS ioctls do for the whole buffer.
+ */
+struct hwchar_dmabuf {
+    __u32 flags;
+    __s32 fd;                   /* returned */
+};
+
+#define HWCHAR_IOC_MAGIC        'H'
+
+#define HWCHAR_IOC_SUBMIT       _IOW(HWCHAR_IOC_MAGIC, 0, struct hwchar_job)
+#define HWCHAR_IOC_REAP         _IOR(HWCHAR_IOC_MAGIC, 1, struct hwchar_completion)
+#define HWCHAR_IOC_DMA_TO_HW    _IOW(HWCHAR_IOC_MAGIC, 2, struct hwchar_range)
+#define HWCHAR_IOC_DMA_FROM_HW  _IOW(HWCHAR_IOC_MAGIC, 3, struct hwchar_range)
+#define HWCHAR_IOC_BEGIN_CPU_ACCESS _IOW(HWCHAR_IOC_MAGIC, 4, struct hwchar_sync)
+#define HWCHAR_IOC_END_CPU_ACCESS   _IOW(HWCHAR_IOC_MAGIC, 5, struct hwchar_sync)
+#define HWCHAR_IOC_EXPORT_DMABUF    _IOWR(HWCHAR_IOC_MAGIC, 6, struct hwchar_dmabuf)
+
+#define HWCHAR_IOC_MAXNR (6)
+
+#endif /* _MMAP_CDMA_MYHW_H_ */
@@ -0,0 +1,344 @@
+/*
+ * soft_dma.ko: a dmaengine memcpy provider done by the CPU
+ *
+ * Lets mmap_CDMA_myHW.ko run its dmaengine data path on any box, without
+ * FPGA and without a DMA controller:
+ *
+ *  $ make ; sudo insmod soft_dma.ko
+ *  $ sudo insmod mmap_CDMA_myHW.ko dmaengine=1 emulate_pl=1
+ *
+ * Every channel is a list of memcpy descriptors; dma_async_issue_pending()
+ * queues a work item that copies them in order and calls their callbacks,
+ * like a real engine completing from its interrupt. The addresses are
+ * those of the soft-dma platform device, which has no IOMMU: bus address
+ * == physical address, copied page by page through kmap_atomic() so
+ * highmem pages (pinned user buffers) work too. Addresses without a struct
+ * page (the PL behind pl_a/pl_b without emulate_pl=1) fail the descriptor,
+ * and the ones issued after it, with DMA_ERROR.
+ *
+ * Author  :   Sergio Rivera <srivera@alumnos.upm.es>
+ *
+*/
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/highmem.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/dmaengine.h>
+#include <linux/dma-mapping.h>
+#include <linux/platform_device.h>
+#include <linux/moduleparam.h>
+#include <linux/delay.h>
+
+#define SOFT_DMA_NAME       "soft-dma"
+#define SOFT_DMA_MAX_CHANS  8
+
+static unsigned int nr_chans = 1;
+module_param(nr_chans, uint, S_IRUGO);
+MODULE_PARM_DESC(nr_chans, "number of memcpy channels (max 8)");
+
+static unsigned int mbps = 0;
+module_param(mbps, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(mbps, "throttle every channel to this many MB/s to model a real engine (0: memcpy speed)");
+
+struct soft_desc {
+    struct dma_async_tx_descriptor tx;
+    struct list_head node;
+    dma_addr_t dst;
+    dma_addr_t src;
+    size_t len;
+};
+
+struct soft_chan {
+    struct dma_chan chan;
+    spinlock_t lock;
+    struct list_head submitted;     /* dmaengine_submit() */
+    struct list_head issued;        /* dma_async_issue_pending() */
+    struct work_struct work;
+    dma_cookie_t err_first;         /* last run of failed descriptors */
+    dma_cookie_t err_last;
+};
+
+static struct dma_device soft_dma;
+static struct soft_chan soft_chans[SOFT_DMA_MAX_CHANS];
+static struct platform_device *soft_pdev;
+
+static struct soft_chan *to_soft_chan(struct dma_chan *c)
+{
+    return container_of(c, struct soft_chan, chan);
+}
+
+/* bus address to bus address, one page (of each side) at a time. RAM only:
+ * -EFAULT on an address with no struct page (MMIO)
+ */
+static int soft_copy(dma_addr_t dst, dma_addr_t src, size_t len)
+{
+    size_t n;
+    char *d, *s;
+
+    while (len) {
+        if (!pfn_valid(PHYS_PFN(dst)) || !pfn_valid(PHYS_PFN(src)))
+            return -EFAULT;
+        n = min3(len, PAGE_SIZE - offset_in_page(dst), PAGE_SIZE - offset_in_page(src));
+        d = kmap_atomic(pfn_to_page(PHYS_PFN(dst)));
+        s = kmap_atomic(pfn_to_page(PHYS_PFN(src)));
+        memcpy(d + offset_in_page(dst), s + offset_in_page(src), n);
+        kunmap_atomic(s);
+        kunmap_atomic(d);
+        dst += n;
+        src += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* the "engine": complete the issued descriptors in order */
+static void soft_chan_work(struct work_struct *work)
+{
+    struct soft_chan *sc = container_of(work, struct soft_chan, work);
+    struct soft_desc *d;
+    unsigned long flags;
+    bool failed = false;
+    u64 t0;
+
+    for (;;) {
+        spin_lock_irqsave(&sc->lock, flags);
+        d = list_first_entry_or_null(&sc->issued, struct soft_desc, node);
+        if (d)
+            list_del(&d->node);
+        spin_unlock_irqrestore(&sc->lock, flags);
+        if (d == NULL)
+            break;
+
+        /* like a halted engine: nothing issued after an error is copied */
+        t0 = ktime_get_ns();
+        if (!failed && soft_copy(d->dst, d->src, d->len)) {
+            pr_err_ratelimited("soft_dma: %pad -> %pad is not RAM\n", &d->src, &d->dst);
+            failed = true;
+            spin_lock_irqsave(&sc->lock, flags);
+            sc->err_first = d->tx.cookie;
+            spin_unlock_irqrestore(&sc->lock, flags);
+        }
+        if (mbps && !failed) {
+            /* bytes / (MB/s) = us */
+            u64 us = div_u64(d->len, mbps);
+            u64 spent = div_u64(ktime_get_ns() - t0, 1000);
+
+            if (us > spent)
+                usleep_range(us - spent, us - spent + 10);
+        }
+
+        spin_lock_irqsave(&sc->lock, flags);
+        sc->chan.completed_cookie = d->tx.cookie;
+        if (failed)
+            sc->err_last = d->tx.cookie;
+        spin_unlock_irqrestore(&sc->lock, flags);
+
+        if (d->tx.callback)
+            d->tx.callback(d->tx.callback_param);
+        kfree(d);
+        cond_resched();
+    }
+}
+
+static dma_cookie_t soft_tx_submit(struct dma_async_tx_descriptor *tx)
+{
+    struct soft_chan *sc = to_soft_chan(tx->chan);
+    struct soft_desc *d = container_of(tx, struct soft_desc, tx);
+    dma_cookie_t cookie;
+    unsigned long flags;
+
+    spin_lock_irqsave(&sc->lock, flags);
+    cookie = sc->chan.cookie + 1;
+    if (cookie < DMA_MIN_COOKIE)
+        cookie = DMA_MIN_COOKIE;
+    sc->chan.cookie = tx->cookie = cookie;
+    list_add_tail(&d->node, &sc->submitted);
+    spin_unlock_irqrestore(&sc->lock, flags);
+
+    return cookie;
+}
+
+static struct dma_async_tx_descriptor *
+soft_prep_memcpy(struct dma_chan *c, dma_addr_t dst, dma_addr_t src, size_t len, unsigned long flags)
+{
+    struct soft_desc *d;
+
+    d = kzalloc(sizeof(*d), GFP_NOWAIT);
+    if (d == NULL)
+        return NULL;
+
+    dma_async_tx_descriptor_init(&d->tx, c);
+    d->tx.flags = flags;
+    d->tx.tx_submit = soft_tx_submit;
+    d->dst = dst;
+    d->src = src;
+    d->len = len;
+    return &d->tx;
+}
+
+static void soft_issue_pending(struct dma_chan *c)
+{
+    struct soft_chan *sc = to_soft_chan(c);
+    unsigned long flags;
+
+    spin_lock_irqsave(&sc->lock, flags);
+    list_splice_tail_init(&sc->submitted, &sc->issued);
+    spin_unlock_irqrestore(&sc->lock, flags);
+
+    queue_work(system_unbound_wq, &sc->work);
+}
+
+static enum dma_status soft_tx_status(struct dma_chan *c, dma_cookie_t cookie,
+                                      struct dma_tx_state *state)
+{
+    struct soft_chan *sc = to_soft_chan(c);
+    dma_cookie_t last, used, err_first, err_last;
+    enum dma_status status;
+    unsigned long flags;
+
+    spin_lock_irqsave(&sc->lock, flags);
+    last = c->completed_cookie;
+    used = c->cookie;
+    err_first = sc->err_first;
+    err_last = sc->err_last;
+    spin_unlock_irqrestore(&sc->lock, flags);
+
+    dma_set_tx_state(state, last, used, 0);
+    status = dma_async_is_complete(cookie, last, used);
+    if (status == DMA_COMPLETE && err_first && cookie >= err_first && cookie <= err_last)
+        return DMA_ERROR;
+    return status;
+}
+
+/* drop what has not been copied yet, the running copy finishes */
+static int soft_terminate_all(struct dma_chan *c)
+{
+    struct soft_chan *sc = to_soft_chan(c);
+    struct soft_desc *d, *tmp;
+    unsigned long flags;
+    LIST_HEAD(head);
+
+    spin_lock_irqsave(&sc->lock, flags);
+    list_splice_tail_init(&sc->submitted, &head);
+    list_splice_tail_init(&sc->issued, &head);
+    spin_unlock_irqrestore(&sc->lock, flags);
+
+    list_for_each_entry_safe(d, tmp, &head, node)
+        kfree(d);
+    return 0;
+}
+
+static void soft_synchronize(struct dma_chan *c)
+{
+    flush_work(&to_soft_chan(c)->work);
+}
+
+static int soft_alloc_chan_resources(struct dma_chan *c)
+{
+    c->completed_cookie = c->cookie = DMA_MIN_COOKIE;
+    return 1;
+}
+
+static void soft_free_chan_resources(struct dma_chan *c)
+{
+    soft_terminate_all(c);
+    soft_synchronize(c);
+}
+
+static int soft_dma_probe(struct platform_device *pdev)
+{
+    struct dma_device *dd = &soft_dma;
+    int i, ret;
+
+    ret = dma_coerce_mask_and_coherent(&pdev->dev, DMA_BIT_MASK(32));
+    if (ret)
+        return ret;
+
+    dma_cap_zero(dd->cap_mask);
+    dma_cap_set(DMA_MEMCPY, dd->cap_mask);
+    dd->dev = &pdev->dev;
+    dd->device_alloc_chan_resources = soft_alloc_chan_resources;
+    dd->device_free_chan_resources = soft_free_chan_resources;
+    dd->device_prep_dma_memcpy = soft_prep_memcpy;
+    dd->device_issue_pending = soft_issue_pending;
+    dd->device_tx_status = soft_tx_status;
+    dd->device_terminate_all = soft_terminate_all;
+    dd->device_synchronize = soft_synchronize;
+    INIT_LIST_HEAD(&dd->channels);
+
+    for (i = 0; i < nr_chans; i++) {
+        struct soft_chan *sc = &soft_chans[i];
+
+        spin_lock_init(&sc->lock);
+        INIT_LIST_HEAD(&sc->submitted);
+        INIT_LIST_HEAD(&sc->issued);
+        INIT_WORK(&sc->work, soft_chan_work);
+        sc->chan.device = dd;
+        list_add_tail(&sc->chan.device_node, &dd->channels);
+    }
+
+    ret = dma_async_device_register(dd);
+    if (ret) {
+        dev_err(&pdev->dev, "dma_async_device_register() %d\n", ret);
+        return ret;
+    }
+    dev_info(&pdev->dev, "%u memcpy channel(s)\n", nr_chans);
+    return 0;
+}
+
+static int soft_dma_remove(struct platform_device *pdev)
+{
+    dma_async_device_unregister(&soft_dma);
+    return 0;
+}
+
+static struct platform_driver soft_dma_driver = {
+    .probe = soft_dma_probe,
+    .remove = soft_dma_remove,
+    .driver = {
+        .name = SOFT_DMA_NAME,
+        .owner = THIS_MODULE,
+    },
+};
+
+static int __init soft_dma_init(void)
+{
+    int ret;
+
+    if (nr_chans < 1 || nr_chans > SOFT_DMA_MAX_CHANS) {
+        printk(KERN_ERR "soft_dma: nr_chans must be 1..%d\n", SOFT_DMA_MAX_CHANS);
+        return -EINVAL;
+    }
+
+    /* dmaengine takes a reference on the driver of the device, so a real
+     * driver/device pair instead of a bare device
+     */
+    ret = platform_driver_register(&soft_dma_driver);
+    if (ret)
+        return ret;
+
+    soft_pdev = platform_device_register_simple(SOFT_DMA_NAME, -1, NULL, 0);
+    if (IS_ERR(soft_pdev)) {
+        platform_driver_unregister(&soft_dma_driver);
+        return PTR_ERR(soft_pdev);
+    }
+    return 0;
+}
+
+static void __exit soft_dma_exit(void)
+{
+    platform_device_unregister(soft_pdev);
+    platform_driver_unregister(&soft_dma_driver);
+}
+
+module_init(soft_dma_init);
+module_exit(soft_dma_exit);
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("sergio rivera <srivera@alumnos.upm.es>");
+MODULE_DESCRIPTION("CPU memcpy dmaengine provider for testing hwchar");
+MODULE_VERSION("1.0");
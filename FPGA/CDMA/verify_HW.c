@@ -0,0 +1,148 @@
+/* x86_64 + arm
+ *
+ * DMA round trip verification for /dev/hwchar
+ *
+ *  1) sudo insmod mmap_CDMA_myHW.ko
+ *  2) gcc -Wall -O2 -pthread -o verify_HW verify_HW.c hwchar_verify.c hwchar_client.c
+ *     sudo ./verify_HW
+ *
+ * Every iteration fills the mapped DMA buffer with a new pattern, DMAs it to
+ * the HW, clears the buffer, DMAs it back and compares it with the pattern
+ * (hwchar_verify.c: SIMD, -t threads). With -p the PL windows a and b are
+ * checked too, straight from /dev/mem (mapped once), which tells a broken
+ * write from a broken read. Mismatches are printed as ranges:
+ *
+ *  $ sudo ./verify_HW -s 4194304 -n 10 -t 4 -p
+ *  read back: 4096 bytes differ in 1 range(s)
+ *    [0x00100000, 0x00101000)     4096 bytes  got 00000000 want 6a09e667
+ *
+ * Author  :   Sergio Rivera <srivera@alumnos.upm.es>
+ *
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include "hwchar_client.h"
+#include "hwchar_verify.h"
+
+#define a_BASE_ADDRESS          0xa0000000  // a address as seen from PS
+#define b_BASE_ADDRESS          0xa0000000  // b address as seen from PS
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* compare and report, 1 when they differ */
+static int check(const char *what, const void *got, const void *want, size_t len,
+                 int nthreads, size_t max) {
+    struct hwverify_result res;
+    uint64_t t0 = now_ns();
+    int ret;
+
+    ret = hwverify_compare(got, want, len, nthreads, max, &res);
+    if (ret < 0) {
+        fprintf(stderr, "%s: %s\n", what, strerror(-ret));
+        return 1;
+    }
+    fprintf(stderr, "%s: %zu bytes checked in %.3f ms\n", what, len, (now_ns() - t0) / 1e6);
+    if (ret)
+        hwverify_print(what, got, want, &res);
+    hwverify_free(&res);
+    return ret;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-d dev] [-s bytes] [-n iters] [-t threads] [-m max_ranges] [-p] [-a phys] [-b phys]\n"
+            "  -s defaults to the whole DMA buffer, -p also checks the PL windows a and b\n", prog);
+}
+
+int main(int argc, char **argv) {
+    const char *device = HWCHAR_DEVICE_FILENAME;
+    unsigned long a_phys = a_BASE_ADDRESS, b_phys = b_BASE_ADDRESS;
+    size_t size = 0, max = 16;
+    int iters = 1, nthreads = 4, pl = 0;
+    struct hwchar h;
+    char *want, *snap = NULL;
+    void *a = NULL, *b = NULL;
+    int opt, i, ret, bad = 0;
+
+    while ((opt = getopt(argc, argv, "d:s:n:t:m:pa:b:h")) != -1) {
+        switch (opt) {
+        case 'd': device = optarg; break;
+        case 's': size = strtoul(optarg, NULL, 0); break;
+        case 'n': iters = atoi(optarg); break;
+        case 't': nthreads = atoi(optarg); break;
+        case 'm': max = strtoul(optarg, NULL, 0); break;
+        case 'p': pl = 1; break;
+        case 'a': a_phys = strtoul(optarg, NULL, 0); break;
+        case 'b': b_phys = strtoul(optarg, NULL, 0); break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+
+    /* slot 0 is the whole transfer */
+    size &= ~(size_t)3;
+    ret = hwchar_open(&h, device, 0, size);
+    if (ret < 0) {
+        fprintf(stderr, "%s: %s\n", device, strerror(-ret));
+        return 1;
+    }
+    size = h.slot_size & ~(size_t)3;
+
+    want = malloc(size);
+    if (pl) {
+        snap = malloc(size);
+        a = hwverify_map_pl(a_phys, size);
+        b = hwverify_map_pl(b_phys, size);
+        if (a == NULL || b == NULL) {
+            perror("/dev/mem");
+            return 1;
+        }
+    }
+
+    for (i = 0; i < iters; i++) {
+        hwverify_pattern(want, size, now_ns());
+        memcpy(hwchar_slot(&h, 0), want, size);
+        ret = hwchar_xfer(&h, 0, HWCHAR_TO_HW, size);
+        if (ret < 0) {
+            fprintf(stderr, "DMA to HW: %s\n", strerror(-ret));
+            return 1;
+        }
+        if (pl) {
+            hwverify_copy_pl(snap, a, size);
+            bad |= check("PL a", snap, want, size, nthreads, max);
+            hwverify_copy_pl(snap, b, size);
+            bad |= check("PL b", snap, want, size, nthreads, max);
+        }
+
+        memset(hwchar_slot(&h, 0), 0, size);
+        ret = hwchar_xfer(&h, 0, HWCHAR_FROM_HW, size);
+        if (ret < 0) {
+            fprintf(stderr, "DMA from HW: %s\n", strerror(-ret));
+            return 1;
+        }
+        bad |= check("read back", hwchar_slot(&h, 0), want, size, nthreads, max);
+        if (bad)
+            break;
+    }
+    printf("%s after %d iteration(s) of %zu bytes\n", bad ? "MISMATCH" : "all good",
+           i < iters ? i + 1 : iters, size);
+
+    if (pl) {
+        hwverify_unmap_pl(a, size);
+        hwverify_unmap_pl(b, size);
+        free(snap);
+    }
+    free(want);
+    hwchar_close(&h);
+    return bad;
+}
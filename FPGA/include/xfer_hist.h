@@ -0,0 +1,182 @@
+#ifndef _XFER_HIST_H_
+#define _XFER_HIST_H_
+
+/*
+ * Per-CPU log2 histograms of transfer latency and size, shared by the
+ * FPGA drivers and exported in debugfs:
+ *
+ *   /sys/kernel/debug/<driver>/read     histograms of read()
+ *   /sys/kernel/debug/<driver>/write    histograms of write()
+ *   /sys/kernel/debug/<driver>/reset    write anything to clear them
+ *
+ * xfer_hist_add() is a couple of this_cpu_inc(): no lock, no printk, so it
+ * can stay in the hot path. Bucket i counts values in [2^(i-1), 2^i),
+ * percentiles are reported as the upper bound of their bucket.
+ *
+ * Author  :   Sergio Rivera <srivera@alumnos.upm.es>
+ */
+
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/bitops.h>
+#include <linux/fs.h>
+#include <linux/math64.h>
+
+#define XFER_HIST_BUCKETS   40      /* up to 2^39 ns (~9 min) or bytes */
+
+#define XFER_READ           0
+#define XFER_WRITE          1
+#define XFER_DIRS           2
+
+struct xfer_hist_cpu {
+    u64 lat[XFER_HIST_BUCKETS];     /* ns */
+    u64 len[XFER_HIST_BUCKETS];     /* bytes */
+};
+
+struct xfer_hist_set {
+    struct xfer_hist_cpu __percpu *cpu[XFER_DIRS];
+    struct dentry *dir;
+};
+
+static inline int xfer_hist_bucket(u64 v)
+{
+    return min_t(int, fls64(v), XFER_HIST_BUCKETS - 1);
+}
+
+static inline void xfer_hist_add(struct xfer_hist_set *set, int dir, u64 ns, u64 bytes)
+{
+    if (set->cpu[dir] == NULL)
+        return;
+    this_cpu_inc(set->cpu[dir]->lat[xfer_hist_bucket(ns)]);
+    this_cpu_inc(set->cpu[dir]->len[xfer_hist_bucket(bytes)]);
+}
+
+/* upper bound of the bucket holding the pct percentile of h */
+static inline u64 xfer_hist_pct(const u64 *h, u64 total, int pct)
+{
+    u64 sum = 0, want = div64_u64(total * pct + 99, 100);
+    int i;
+
+    for (i = 0; i < XFER_HIST_BUCKETS; i++) {
+        sum += h[i];
+        if (sum >= want && sum)
+            return i ? 1ULL << i : 0;
+    }
+    return 0;
+}
+
+static inline void xfer_hist_show_one(struct seq_file *m, const char *name, const u64 *h)
+{
+    u64 total = 0, max = 0;
+    int i;
+
+    for (i = 0; i < XFER_HIST_BUCKETS; i++) {
+        total += h[i];
+        if (h[i])
+            max = i ? 1ULL << i : 0;
+    }
+    seq_printf(m, "%s p50 %llu p90 %llu p99 %llu max %llu\n", name,
+               xfer_hist_pct(h, total, 50), xfer_hist_pct(h, total, 90),
+               xfer_hist_pct(h, total, 99), max);
+    for (i = 0; i < XFER_HIST_BUCKETS; i++)
+        if (h[i])
+            seq_printf(m, "%s_le %llu %llu\n", name, i ? 1ULL << i : 0, h[i]);
+}
+
+static inline int xfer_hist_show(struct seq_file *m, void *v)
+{
+    struct xfer_hist_cpu __percpu *pcpu = m->private;
+    struct xfer_hist_cpu sum;
+    u64 ops = 0;
+    int cpu, i;
+
+    memset(&sum, 0, sizeof(sum));
+    for_each_possible_cpu(cpu) {
+        struct xfer_hist_cpu *c = per_cpu_ptr(pcpu, cpu);
+
+        for (i = 0; i < XFER_HIST_BUCKETS; i++) {
+            sum.lat[i] += READ_ONCE(c->lat[i]);
+            sum.len[i] += READ_ONCE(c->len[i]);
+        }
+    }
+    for (i = 0; i < XFER_HIST_BUCKETS; i++)
+        ops += sum.lat[i];
+
+    seq_printf(m, "ops %llu\n", ops);
+    xfer_hist_show_one(m, "latency_ns", sum.lat);
+    xfer_hist_show_one(m, "bytes", sum.len);
+    return 0;
+}
+
+static inline int xfer_hist_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, xfer_hist_show, inode->i_private);
+}
+
+static const struct file_operations xfer_hist_fops = {
+    .owner = THIS_MODULE,
+    .open = xfer_hist_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+/* counters may be bumped while they are cleared, good enough for a reset */
+static inline ssize_t xfer_hist_reset_write(struct file *file, const char __user *buf,
+                                            size_t len, loff_t *ppos)
+{
+    struct xfer_hist_set *set = file_inode(file)->i_private;
+    int dir, cpu;
+
+    for (dir = 0; dir < XFER_DIRS; dir++)
+        for_each_possible_cpu(cpu)
+            memset(per_cpu_ptr(set->cpu[dir], cpu), 0, sizeof(struct xfer_hist_cpu));
+    return len;
+}
+
+static const struct file_operations xfer_hist_reset_fops = {
+    .owner = THIS_MODULE,
+    .open = simple_open,
+    .write = xfer_hist_reset_write,
+    .llseek = noop_llseek,
+};
+
+static inline void xfer_hist_exit(struct xfer_hist_set *set)
+{
+    int dir;
+
+    debugfs_remove_recursive(set->dir);
+    set->dir = NULL;
+    for (dir = 0; dir < XFER_DIRS; dir++) {
+        free_percpu(set->cpu[dir]);
+        set->cpu[dir] = NULL;
+    }
+}
+
+/* allocate the histograms and publish them in /sys/kernel/debug/<name>/ */
+static inline int xfer_hist_init(struct xfer_hist_set *set, const char *name)
+{
+    int dir;
+
+    for (dir = 0; dir < XFER_DIRS; dir++) {
+        set->cpu[dir] = alloc_percpu(struct xfer_hist_cpu);
+        if (set->cpu[dir] == NULL) {
+            xfer_hist_exit(set);
+            return -ENOMEM;
+        }
+    }
+
+    /* without debugfs the histograms are still kept, just not shown */
+    set->dir = debugfs_create_dir(name, NULL);
+    if (IS_ERR_OR_NULL(set->dir)) {
+        set->dir = NULL;
+        return 0;
+    }
+    debugfs_create_file("read", 0444, set->dir, set->cpu[XFER_READ], &xfer_hist_fops);
+    debugfs_create_file("write", 0444, set->dir, set->cpu[XFER_WRITE], &xfer_hist_fops);
+    debugfs_create_file("reset", 0200, set->dir, set, &xfer_hist_reset_fops);
+    return 0;
+}
+
+#endif /* _XFER_HIST_H_ */